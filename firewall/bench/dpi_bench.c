@@ -0,0 +1,197 @@
+/* Userspace benchmark of the DPI signature matching.
+ * The http and smtp line checks of the module are built from its own source -
+ * the signature matching and protocol parser sections of fw_dpi.c, which the
+ * Makefile extracts to dpi_sigs.inc - and timed against the strstr based
+ * checks they replaced, over a fixed mix of http and mail lines. The verdicts
+ * of both are compared on every line.
+ * Run it with "make bench" in the firewall directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+/* Kernel stand-ins */
+/********************/
+
+typedef unsigned char __u8;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+#define NF_DROP 0
+#define NF_ACCEPT 1
+#define KERN_NOTICE ""
+#define printk(...) ((void)0) // the checks log what they block
+#define likely(x) __builtin_expect(!!(x), 1)
+#define __ffs(x) __builtin_ctz(x)
+#define GFP_KERNEL 0
+#define vzalloc(size) calloc(1, size)
+#define vfree free
+#define kzalloc(size, flags) calloc(1, size)
+#define kmalloc(size, flags) malloc(size)
+#define kfree free
+
+// the part of a connection the parsers use
+typedef struct {
+    __u8 dpi_state;
+    u32 dpi_left;
+    u32 dpi_length;
+} connection;
+
+static int check_hosts(const char *host, unsigned int len){
+    return 0;
+}
+
+static int hex_to_bin(char ch){
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    ch = tolower(ch);
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    return -1;
+}
+
+/* lib/string.c */
+static char * strnstr(const char *s1, const char *s2, size_t len){
+    size_t l2 = strlen(s2);
+    if (!l2)
+        return (char *)s1;
+    while (len >= l2){
+        len--;
+        if (!memcmp(s1, s2, l2))
+            return (char *)s1;
+        s1++;
+    }
+    return NULL;
+}
+
+static char * kstrstr(const char *s1, const char *s2){
+    size_t l1, l2 = strlen(s2);
+    if (!l2)
+        return (char *)s1;
+    for (l1 = strlen(s1); l1 >= l2; --l1, ++s1){
+        if (!memcmp(s1, s2, l2))
+            return (char *)s1;
+    }
+    return NULL;
+}
+
+#include "dpi_sigs.inc"
+
+/* The checks before the automaton */
+/***********************************/
+
+/* check if a string contains C code using several common patterns */
+static int old_is_c_code(const char *str){
+    return (kstrstr(str, "#include ") || kstrstr(str, "#define ") || kstrstr(str, "#ifdef ") ||
+            kstrstr(str, "int main(") || kstrstr(str, "void main(") || kstrstr(str, "return 0;") ||
+            kstrstr(str, "printf(\"") || kstrstr(str, "malloc(") || kstrstr(str, "return;"));
+}
+
+/* check if the value after a CPG parameter is not numeric */
+static int old_bad_cpg(const char *buf, const char *name, int allow_comma){
+    const char *res = kstrstr(buf, name);
+    if (!res)
+        return 0;
+    for (res += strlen(name); *res != '\0' && *res != '\r' && *res != '&'; ++res){
+        if (!isdigit(*res) && !(allow_comma && *res == ','))
+            return 1;
+    }
+    return 0;
+}
+
+/* the http check of a line, a host line is only checked for the host */
+static __u8 old_http(const char *line){
+    if (kstrstr(line, "Host: "))
+        return check_hosts(line, 0) ? NF_DROP : NF_ACCEPT;
+    if (kstrstr(line, "index.php?") && kstrstr(line, "action=6"))
+        return NF_DROP;
+    if (old_bad_cpg(line, "angle=", 0) || old_bad_cpg(line, "rotate=", 0) || old_bad_cpg(line, "clipval=", 1))
+        return NF_DROP;
+    return old_is_c_code(line) ? NF_DROP : NF_ACCEPT;
+}
+
+static __u8 old_smtp(const char *line){
+    return old_is_c_code(line) ? NF_DROP : NF_ACCEPT;
+}
+
+/* The benchmark */
+/*****************/
+
+#define LINES 40000
+#define ROUNDS 200
+
+// http headers and requests, and mail commands and bodies
+static const char *samples[] = {
+    "GET /index.html HTTP/1.1",
+    "GET /index.php?action=6&file=x HTTP/1.1",
+    "GET /cpg/index.php?angle=90&rotate=12&clipval=1,2,3 HTTP/1.1",
+    "POST /upload HTTP/1.1",
+    "Host: www.example.com",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/45.0 Safari/537.36",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+    "Accept-Language: en-US,en;q=0.8",
+    "Accept-Encoding: gzip, deflate",
+    "Cookie: session=abcdef0123456789; theme=dark; tracking=xyz",
+    "angle=9x",
+    "MAIL FROM:<alice@example.com>",
+    "RCPT TO:<bob@example.com>",
+    "Subject: weekly report",
+    "Hi Bob, please find the numbers for this week below, the totals are unchanged.",
+    "Regards, Alice",
+    "#include <stdio.h>",
+    "int main(int argc, char **argv){",
+    "    printf(\"hello\\n\");",
+    "    return 0;"
+};
+
+static double seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* time a check over all the lines, returns the rate in MB/s */
+static double run(int check, const char **lines, const unsigned int *lens, size_t bytes){
+    volatile unsigned int sink = 0;
+    double start = seconds();
+    int round, i;
+    for (round = 0; round < ROUNDS; ++round){
+        for (i = 0; i < LINES; ++i){
+            switch (check){
+            case 0: sink += old_http(lines[i]); break;
+            case 1: sink += check_http_params((char *)lines[i], lens[i], 1); break;
+            case 2: sink += old_smtp(lines[i]); break;
+            case 3: sink += check_c_code((char *)lines[i], lens[i]); break;
+            }
+        }
+    }
+    return bytes * (double)ROUNDS / (seconds() - start) / 1e6;
+}
+
+int main(void){
+    static const char *lines[LINES];
+    static unsigned int lens[LINES];
+    size_t bytes = 0;
+    int i, mismatches = 0;
+    if (build_dpi_ac()){
+        fprintf(stderr, "Error building the automaton\n");
+        return 1;
+    }
+    srand(1); //the same mix on every run
+    for (i = 0; i < LINES; ++i){
+        lines[i] = samples[rand() % (sizeof(samples) / sizeof(*samples))];
+        lens[i] = strlen(lines[i]);
+        bytes += lens[i];
+        if (old_http(lines[i]) != (kstrstr(lines[i], "Host: ") ? NF_ACCEPT : check_http_params((char *)lines[i], lens[i], 1)) ||
+            old_smtp(lines[i]) != check_c_code((char *)lines[i], lens[i]))
+            ++mismatches;
+    }
+    printf("%d lines, %zu bytes, %d verdict mismatches\n", LINES, bytes, mismatches);
+    printf("http: strstr %.0f MB/s, automaton %.0f MB/s\n", run(0, lines, lens, bytes), run(1, lines, lens, bytes));
+    printf("smtp: strstr %.0f MB/s, automaton %.0f MB/s\n", run(2, lines, lens, bytes), run(3, lines, lens, bytes));
+    return mismatches != 0;
+}
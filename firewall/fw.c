@@ -25,14 +25,22 @@ static int init_sysfs_class(void){
  */
 static void cleanup_firewall(int step){
     switch (step){
-    case 7:
+    case 11:
         cleanup_filter();
-    case 6:
+    case 10:
         cleanup_hosts();
-    case 5:
+    case 9:
         cleanup_conn_tab();
-    case 4:
+    case 8:
+        cleanup_expect();
+    case 7:
+        cleanup_events();
+    case 6:
+        cleanup_dpi();
+    case 5:
         cleanup_rules();
+    case 4:
+        cleanup_sets();
     case 3:
         cleanup_stats();
     case 2:
@@ -65,28 +73,52 @@ static int __init firewall_init_function(void) {
         cleanup_firewall(2);
         return err;
     }
+    //init sets
+    if ((err = init_sets())){
+        PERR("sets interface init failed");
+        cleanup_firewall(3);
+        return err;
+    }
     //init rules
     if ((err = init_rules())){
         PERR("rules interface init failed");
-        cleanup_firewall(3);
+        cleanup_firewall(4);
+        return err;
+    }
+    //init dpi
+    if ((err = init_dpi())){
+        PERR("dpi init failed");
+        cleanup_firewall(5);
+        return err;
+    }
+    //init conn_events
+    if ((err = init_events())){
+        PERR("conn_events interface init failed");
+        cleanup_firewall(6);
+        return err;
+    }
+    //init ftp expectations
+    if ((err = init_expect())){
+        PERR("ftp expectations init failed");
+        cleanup_firewall(7);
         return err;
     }
     //init conn_tab
     if ((err = init_conn_tab())){
         PERR("rules interface init failed");
-        cleanup_firewall(4);
+        cleanup_firewall(8);
         return err;
     }
     //init hosts
     if ((err = init_hosts())){
         PERR("hosts interface init failed");
-        cleanup_firewall(5);
+        cleanup_firewall(9);
         return err;
     }
     //init filter
     if ((err = init_filter())){
         PERR("filter init failed");
-        cleanup_firewall(6);
+        cleanup_firewall(10);
         return err;
     }
 #ifdef DEBUG
@@ -97,7 +129,7 @@ static int __init firewall_init_function(void) {
 
 /* cleanup all modules */
 static void __exit firewall_exit_function(void) {
-    cleanup_firewall(7);
+    cleanup_firewall(11);
 }
 
 module_init(firewall_init_function);
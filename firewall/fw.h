@@ -9,16 +9,34 @@
 #include <linux/netfilter_ipv4.h>
 #include <linux/ip.h>
 #include <linux/tcp.h>
+#include <net/tcp.h>
 #include <linux/udp.h>
 #include <linux/list.h>
 #include <linux/time.h>
 #include <linux/ctype.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/compat.h>
 //include all our modules
 #include "fw_filter.h"
 #include "fw_stats.h"
 #include "fw_log.h"
+#include "fw_sets.h"
 #include "fw_rules.h"
+#include "fw_classify.h"
 #include "fw_conn_tab.h"
+#include "fw_events.h"
+#include "fw_expect.h"
+#include "fw_dpi.h"
 #include "fw_hosts.h"
 #include "util.h"
 
@@ -0,0 +1,364 @@
+#include "fw.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Tomer Brisker");
+
+/*****************************
+ * Packet classifier module  *
+ *****************************/
+
+/* Field helpers */
+/*****************/
+
+/* get the protocol class of a protocol */
+static unsigned int prot_class(__u8 protocol){
+    switch (protocol){
+    case PROT_ICMP:
+        return 0;
+    case PROT_TCP:
+        return 1;
+    case PROT_UDP:
+        return 2;
+    case PROT_OTHER:
+        return 3;
+    }
+    return 4; //only matched by rules for any protocol
+}
+
+/* get the range of addresses, in host order, a rule's address and prefix size match */
+static void rule_ip_range(const rule_t *rule, int dst, u32 *lo, u32 *hi){
+    __be32 ip = dst ? rule->dst_ip : rule->src_ip;
+    __u8 nps = dst ? rule->dst_prefix_size : rule->src_prefix_size;
+    u32 mask = (ip != 0 && nps != 0) ? ~0U << (32 - nps) : 0; //ip or prefix == 0 -> any
+    *lo = ntohl(ip) & mask;
+    *hi = *lo | ~mask;
+}
+
+/* get a rule's port. Like the packet's ports it is compared as is */
+static u16 rule_port(const rule_t *rule, int dst){
+    return dst ? rule->dst_port : rule->src_port;
+}
+
+/* the set fields of a rule, in the order of the classifier's set refs */
+static const size_t set_fields[CLASSIFY_SET_FIELDS] = {
+    offsetof(rule_t, src_ip_set),
+    offsetof(rule_t, dst_ip_set),
+    offsetof(rule_t, src_port_set),
+    offsetof(rule_t, dst_port_set)
+};
+
+/* get the id of the set a rule uses in a set field, or 0 */
+static unsigned int rule_set(const rule_t *rule, unsigned int field){
+    return *((const __u8 *)rule + set_fields[field]);
+}
+
+/* compare addresses for sorting */
+static int cmp_ip(const void *a, const void *b){
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Building the classifier */
+/***************************/
+
+/* find the starts of the address classes of a field - every address where a
+ * rule's range starts or ends. starts must have room for 2 * count + 1 addresses.
+ * returns the number of classes.
+ */
+static unsigned int find_ip_starts(const rule_t *rules, unsigned int count, int dst, u32 *starts){
+    unsigned int i, n = 0, classes = 1;
+    u32 lo, hi;
+    starts[n++] = 0;
+    for (i = 0; i < count; ++i){
+        rule_ip_range(&rules[i], dst, &lo, &hi);
+        starts[n++] = lo;
+        if (hi != ~0U)
+            starts[n++] = hi + 1;
+    }
+    sort(starts, n, sizeof(u32), cmp_ip, NULL);
+    for (i = 1; i < n; ++i){ //remove duplicates
+        if (starts[i] != starts[classes - 1])
+            starts[classes++] = starts[i];
+    }
+    return classes;
+}
+
+/* count the port classes of a field - any port that isn't named by a rule, ports
+ * above 1023, and every port a rule names.
+ */
+static unsigned int count_port_classes(const rule_t *rules, unsigned int count, int dst){
+    DECLARE_BITMAP(named, PORT_ABOVE_1023);
+    unsigned int i, classes = 2;
+    u16 port;
+    bitmap_zero(named, PORT_ABOVE_1023);
+    for (i = 0; i < count; ++i){
+        port = rule_port(&rules[i], dst);
+        if (port != PORT_ANY && port != PORT_ABOVE_1023 && !test_and_set_bit(port, named))
+            ++classes;
+    }
+    return classes;
+}
+
+/* find the sets used in a set field. returns the number of sets */
+static unsigned int find_set_refs(struct set_refs *refs, const rule_t *rules, unsigned int count,
+                                  unsigned int field){
+    DECLARE_BITMAP(used, SETS_MAX);
+    unsigned int i, id;
+    bitmap_zero(used, SETS_MAX);
+    refs->count = 0;
+    for (i = 0; i < count; ++i){
+        id = rule_set(&rules[i], field);
+        if (id && !test_and_set_bit(id, used))
+            refs->ids[refs->count++] = id;
+    }
+    return refs->count;
+}
+
+/* get the class of an address */
+static unsigned int find_ip_class(const struct ip_classes *classes, u32 ip){
+    unsigned int lo = 0, hi = classes->count, mid;
+    while (hi - lo > 1){ //the class is the last one starting at or below ip
+        mid = lo + (hi - lo) / 2;
+        if (classes->starts[mid] <= ip)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* set the bitmaps of the address classes of a field, whose starts are set */
+static void fill_ip_classes(struct ip_classes *classes, const rule_t *rules, unsigned int count,
+                            int dst, unsigned int words){
+    unsigned int i, k;
+    u32 lo, hi;
+    for (i = 0; i < count; ++i){
+        rule_ip_range(&rules[i], dst, &lo, &hi);
+        //every class is either inside the rule's range or outside of it
+        for (k = find_ip_class(classes, lo); k < classes->count && classes->starts[k] <= hi; ++k)
+            __set_bit(i, classes->maps + k * words);
+    }
+}
+
+/* set the classes of the ports of a field and their bitmaps */
+static void fill_port_classes(struct port_classes *classes, const rule_t *rules, unsigned int count,
+                              int dst, unsigned int words){
+    unsigned int i, k;
+    u16 port;
+    classes->above = 1; //class 0 is for ports no rule names
+    classes->count = 2;
+    for (i = 0; i < count; ++i){
+        port = rule_port(&rules[i], dst);
+        if (port != PORT_ANY && port != PORT_ABOVE_1023 && !classes->class_of[port])
+            classes->class_of[port] = classes->count++;
+    }
+    for (i = 0; i < count; ++i){
+        port = rule_port(&rules[i], dst);
+        if (port == PORT_ANY){
+            for (k = 0; k < classes->count; ++k)
+                __set_bit(i, classes->maps + k * words);
+        } else if (port == PORT_ABOVE_1023){
+            __set_bit(i, classes->maps + classes->above * words);
+        } else {
+            __set_bit(i, classes->maps + classes->class_of[port] * words);
+        }
+    }
+}
+
+/* set the bitmaps of the sets used in a set field, whose ids are found */
+static void fill_set_refs(struct set_refs *refs, const rule_t *rules, unsigned int count,
+                          unsigned int field, unsigned int words){
+    unsigned int i, k, id;
+    for (i = 0; i < count; ++i){
+        id = rule_set(&rules[i], field);
+        for (k = 0; id && k < refs->count; ++k){
+            if (refs->ids[k] == id)
+                __set_bit(i, refs->maps + k * words);
+        }
+    }
+}
+
+/* set the bitmaps of the protocol, direction and ack fields */
+static void fill_flag_maps(struct rule_classifier *cls, const rule_t *rules, unsigned int count){
+    unsigned int i, k, words = cls->words;
+    for (i = 0; i < count; ++i){
+        for (k = 0; k < CLASSIFY_PROTS; ++k){
+            if (rules[i].protocol == PROT_ANY || prot_class(rules[i].protocol) == k)
+                __set_bit(i, cls->prot_maps + k * words);
+        }
+        for (k = 0; k < CLASSIFY_FLAGS; ++k){
+            if (rules[i].direction == DIRECTION_ANY || rules[i].direction == k)
+                __set_bit(i, cls->dir_maps + k * words);
+            if (rules[i].ack == ACK_ANY || rules[i].ack == k)
+                __set_bit(i, cls->ack_maps + k * words);
+        }
+        cls->actions[i] = rules[i].action;
+    }
+}
+
+/* compile a list of count valid rules, count > 0. returns NULL if we are out of memory */
+struct rule_classifier * compile_rules(const rule_t *rules, unsigned int count){
+    struct rule_classifier *cls;
+    struct set_refs sets[CLASSIFY_SET_FIELDS];
+    unsigned int words = BITS_TO_LONGS(count), maps, set_maps = 0, field;
+    unsigned int src_ips, dst_ips, src_ports, dst_ports;
+    u32 *src_starts, *dst_starts;
+    unsigned long *map;
+    size_t size;
+
+    //the address classes are found first, to know how much room the classifier needs
+    src_starts = vmalloc(2 * (2 * count + 1) * sizeof(u32));
+    if (!src_starts)
+        return NULL;
+    dst_starts = src_starts + 2 * count + 1;
+    src_ips = find_ip_starts(rules, count, 0, src_starts);
+    dst_ips = find_ip_starts(rules, count, 1, dst_starts);
+    src_ports = count_port_classes(rules, count, 0);
+    dst_ports = count_port_classes(rules, count, 1);
+    for (field = 0; field < CLASSIFY_SET_FIELDS; ++field)
+        set_maps += find_set_refs(&sets[field], rules, count, field);
+
+    //the struct, then the bitmaps, the address starts and the actions, each aligned for the next
+    maps = CLASSIFY_PROTS + 2 * CLASSIFY_FLAGS + src_ips + dst_ips + src_ports + dst_ports + set_maps;
+    size = sizeof(struct rule_classifier) + maps * words * sizeof(unsigned long) +
+           (src_ips + dst_ips) * sizeof(u32) + count;
+    cls = vzalloc(size);
+    if (!cls){
+        vfree(src_starts);
+        return NULL;
+    }
+    cls->rules = count;
+    cls->words = words;
+    map = (unsigned long *)(cls + 1);
+    cls->prot_maps = map;
+    cls->dir_maps = cls->prot_maps + CLASSIFY_PROTS * words;
+    cls->ack_maps = cls->dir_maps + CLASSIFY_FLAGS * words;
+    cls->src_ip.maps = cls->ack_maps + CLASSIFY_FLAGS * words;
+    cls->dst_ip.maps = cls->src_ip.maps + src_ips * words;
+    cls->src_port.maps = cls->dst_ip.maps + dst_ips * words;
+    cls->dst_port.maps = cls->src_port.maps + src_ports * words;
+    for (field = 0; field < CLASSIFY_SET_FIELDS; ++field){
+        cls->sets[field] = sets[field];
+        cls->sets[field].maps = field ? cls->sets[field - 1].maps + sets[field - 1].count * words :
+                                        cls->dst_port.maps + dst_ports * words;
+    }
+    cls->src_ip.starts = (u32 *)(map + maps * words);
+    cls->dst_ip.starts = cls->src_ip.starts + src_ips;
+    cls->actions = (__u8 *)(cls->dst_ip.starts + dst_ips);
+
+    cls->src_ip.count = src_ips;
+    cls->dst_ip.count = dst_ips;
+    memcpy(cls->src_ip.starts, src_starts, src_ips * sizeof(u32));
+    memcpy(cls->dst_ip.starts, dst_starts, dst_ips * sizeof(u32));
+    vfree(src_starts);
+
+    fill_flag_maps(cls, rules, count);
+    fill_ip_classes(&cls->src_ip, rules, count, 0, words);
+    fill_ip_classes(&cls->dst_ip, rules, count, 1, words);
+    fill_port_classes(&cls->src_port, rules, count, 0, words);
+    fill_port_classes(&cls->dst_port, rules, count, 1, words);
+    for (field = 0; field < CLASSIFY_SET_FIELDS; ++field)
+        fill_set_refs(&cls->sets[field], rules, count, field, words);
+#ifdef DEBUG
+    printk(KERN_DEBUG "compiled %u rules: %u+%u address classes, %u+%u port classes, %zu bytes\n",
+           count, src_ips, dst_ips, src_ports, dst_ports, size);
+#endif
+    return cls;
+}
+
+/* free a classifier that no one else can use */
+void free_classifier(struct rule_classifier *cls){
+    vfree(cls);
+}
+
+/* Packet lookup */
+/*****************/
+
+/* get the bitmap of the class of a packet's address */
+static const unsigned long * ip_class_map(const struct ip_classes *classes, __be32 ip, unsigned int words){
+    return classes->maps + find_ip_class(classes, ntohl(ip)) * words;
+}
+
+/* get the bitmap of the class of a packet's port */
+static const unsigned long * port_class_map(const struct port_classes *classes, u16 port, unsigned int words){
+    return classes->maps + (port < PORT_ABOVE_1023 ? classes->class_of[port] : classes->above) * words;
+}
+
+/* check if a packet is in a set it is looked up in by a set field */
+static int packet_in_set(const rule_t *packet, unsigned int field, unsigned int id){
+    switch (field){
+    case 0:
+        return ip_set_match(id, packet->src_ip);
+    case 1:
+        return ip_set_match(id, packet->dst_ip);
+    case 2:
+        return port_set_match(id, packet->src_port);
+    }
+    return port_set_match(id, packet->dst_port);
+}
+
+/* remove the candidate rules of word w that use a set the packet isn't in.
+ * Each set is looked up at most once per packet, known and member remember the
+ * sets that were, by id.
+ */
+static unsigned long check_set_refs(const struct rule_classifier *cls, const rule_t *packet,
+                                    unsigned int fields, unsigned int w, unsigned long match,
+                                    u64 *known, u64 *member){
+    const struct set_refs *refs;
+    unsigned int field, k;
+    unsigned long map;
+    u64 bit;
+    for (field = 0; field < fields && match; ++field){
+        refs = &cls->sets[field];
+        for (k = 0; k < refs->count && match; ++k){
+            map = refs->maps[k * cls->words + w];
+            if (!(match & map)) //no candidate uses this set
+                continue;
+            bit = 1ULL << refs->ids[k];
+            if (!(known[field] & bit)){
+                known[field] |= bit;
+                if (packet_in_set(packet, field, refs->ids[k]))
+                    member[field] |= bit;
+            }
+            if (!(member[field] & bit))
+                match &= ~map;
+        }
+    }
+    return match;
+}
+
+/* find the first rule a packet matches and set the packet's action by it.
+ * returns the rule's number, or REASON_NO_MATCHING_RULE if there is none.
+ */
+reason_t classify_packet(const struct rule_classifier *cls, rule_t *packet){
+    const unsigned long *maps[7];
+    unsigned int n = 0, i, w, words = cls->words, rule, fields = 2; //the port sets are only checked with the ports
+    unsigned long match;
+    u64 known[CLASSIFY_SET_FIELDS] = {0}, member[CLASSIFY_SET_FIELDS] = {0};
+
+    maps[n++] = cls->prot_maps + prot_class(packet->protocol) * words;
+    maps[n++] = cls->dir_maps + (packet->direction & (CLASSIFY_FLAGS - 1)) * words;
+    maps[n++] = ip_class_map(&cls->src_ip, packet->src_ip, words);
+    maps[n++] = ip_class_map(&cls->dst_ip, packet->dst_ip, words);
+    if (packet->protocol == PROT_TCP || packet->protocol == PROT_UDP){ //only check ports for protocols that have one
+        maps[n++] = port_class_map(&cls->src_port, packet->src_port, words);
+        maps[n++] = port_class_map(&cls->dst_port, packet->dst_port, words);
+        fields = CLASSIFY_SET_FIELDS;
+    }
+    if (packet->protocol == PROT_TCP) //only check ack for TCP
+        maps[n++] = cls->ack_maps + (packet->ack & (CLASSIFY_FLAGS - 1)) * words;
+
+    for (w = 0; w < words; ++w){ //the first rule is the lowest bit set in all the maps
+        match = maps[0][w];
+        for (i = 1; i < n && match; ++i)
+            match &= maps[i][w];
+        if (match)
+            match = check_set_refs(cls, packet, fields, w, match, known, member);
+        if (match){
+            rule = w * BITS_PER_LONG + __ffs(match);
+            packet->action = cls->actions[rule];
+            return rule;
+        }
+    }
+    return REASON_NO_MATCHING_RULE;
+}
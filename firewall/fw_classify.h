@@ -0,0 +1,75 @@
+#ifndef FW_CLASSIFY_H
+#define FW_CLASSIFY_H
+
+/* The rule list is compiled when it is loaded into a classifier that finds the
+ * first matching rule without trying the rules one by one, by bitmap
+ * intersection. The values of every field are split into classes, such that
+ * all the values of a class match the same rules, and each class has a bitmap
+ * of those rules. A packet matches the lowest rule set in the bitmaps of all of
+ * its classes.
+ * The address classes are intervals of addresses, found by binary search. The
+ * other fields index their classes directly. A lookup costs O(log n) for the
+ * searches and at most n / BITS_PER_LONG words for the intersection, which
+ * stops at the first word with a match.
+ */
+#define CLASSIFY_PROTS 5 // icmp, tcp, udp, other, and any other value
+#define CLASSIFY_FLAGS 4 // direction and ack are indexed by their two bits
+
+/* The classes of an address field. Class k holds the addresses from starts[k]
+ * up to starts[k + 1], in host order. starts[0] is always 0.
+ */
+struct ip_classes {
+    unsigned int count;
+    u32 *starts;
+    unsigned long *maps;
+};
+
+/* The classes of a port field. A port below PORT_ABOVE_1023 is in class_of[port],
+ * any other port is in the above class.
+ */
+struct port_classes {
+    u16 class_of[PORT_ABOVE_1023];
+    u16 above;
+    unsigned int count;
+    unsigned long *maps;
+};
+
+/* The sets used by the rules in a set field - src/dst ip set, src/dst port set.
+ * Set k has a bitmap of the rules that use it, and the packet is only looked up
+ * in a set when a rule that is still a candidate uses it.
+ */
+#define CLASSIFY_SET_FIELDS 4
+struct set_refs {
+    unsigned int count;
+    __u8 ids[SETS_MAX];
+    unsigned long *maps;
+};
+
+/* A compiled rule list. It is allocated in a single block, and isn't changed
+ * once it is built.
+ */
+struct rule_classifier {
+    unsigned int rules; // number of rules
+    unsigned int words; // length of each bitmap, in longs
+    __u8 *actions; // the action of each rule
+    unsigned long *prot_maps; // CLASSIFY_PROTS bitmaps
+    unsigned long *dir_maps; // CLASSIFY_FLAGS bitmaps
+    unsigned long *ack_maps; // CLASSIFY_FLAGS bitmaps
+    struct ip_classes src_ip, dst_ip;
+    struct port_classes src_port, dst_port;
+    struct set_refs sets[CLASSIFY_SET_FIELDS];
+};
+
+/* Packet classifier public interface */
+
+/* compile a list of count valid rules, count > 0. returns NULL if we are out of memory */
+struct rule_classifier * compile_rules(const rule_t *rules, unsigned int count);
+/* free a classifier that no one else can use. Must not be called in atomic context */
+void free_classifier(struct rule_classifier *cls);
+/* find the first rule a packet matches and set the packet's action by it.
+ * returns the rule's number, or REASON_NO_MATCHING_RULE if there is none.
+ * Must be called under rcu_read_lock(), for the sets.
+ */
+reason_t classify_packet(const struct rule_classifier *cls, rule_t *packet);
+
+#endif
@@ -10,239 +10,541 @@ MODULE_AUTHOR("Tomer Brisker");
 /* Internal table representation and helper functions */
 /******************************************************/
 
-static LIST_HEAD(conn_table); // init the list representing the connection table
+/* The connection table is a hash table with chained buckets. Connections are
+ * hashed on a direction independent key, so packets from both sides of a
+ * connection land in the same bucket and a lookup only walks a single chain.
+ *
+ * Concurrency: the hooks run on all cpus at once, so the table is built for
+ * parallel access -
+ * - Lookups are lockless, under rcu_read_lock(). Removed connections are only
+ *   freed after a grace period, so a reader never sees freed memory.
+ * - Inserts, removals and state changes are done under one of CONN_LOCKS
+ *   spinlocks, selected by the connection hash. The table never has less
+ *   buckets than locks, so every bucket is always guarded by the same lock.
+ * - Resizing is done from a work item, which takes all the locks and moves
+ *   the connections to a new table. Lookups that raced with the move retry
+ *   when they see conn_resize_seq changed.
+ */
+struct conn_hash {
+    unsigned int bits; // the table has 2^bits buckets
+    struct hlist_head buckets[];
+};
+
+static struct conn_hash __rcu *conn_table; // the connection table
+static seqcount_t conn_resize_seq; // changed while connections move to a resized table
+static spinlock_t conn_locks[CONN_LOCKS]; // locks guarding the buckets and connection states
+static DEFINE_SPINLOCK(conn_locks_all_lock); // held while a resize owns all the locks
+static int conn_locks_all; // set while a resize owns all the locks
+static struct kmem_cache *conn_cache; // connections are allocated from a dedicated slab cache
+static atomic_t conn_count; // number of connections in the table
+static unsigned int conn_max; // maximal number of connections, evict or refuse new ones beyond it
+static atomic_t conn_evictions, conn_insert_failures; // counters for connections we evicted or couldn't add
+static u32 conn_hash_rnd; // random hash seed, so remote hosts can't predict our buckets
+
+/* Per-state connection timeouts, in seconds */
+static unsigned int handshake_timeout, established_timeout, closing_timeout;
+
+/* hash a connection 4-tuple. The endpoints are ordered before hashing so both
+ * directions of the same connection get the same hash.
+ */
+static u32 hash_tuple(__be32 src_ip, __be16 src_port, __be32 dst_ip, __be16 dst_port){
+    if (src_ip > dst_ip || (src_ip == dst_ip && src_port > dst_port))
+        return jhash_3words(dst_ip, src_ip, ((u32)dst_port << 16) | src_port, conn_hash_rnd);
+    return jhash_3words(src_ip, dst_ip, ((u32)src_port << 16) | dst_port, conn_hash_rnd);
+}
+
+/* get the bucket a given hash maps to */
+static struct hlist_head * conn_bucket(struct conn_hash *table, u32 hash){
+    return &table->buckets[hash & ((1U << table->bits) - 1)];
+}
 
-/* removes a connection from the connection table and frees its memory */
+/* allocate an empty table with 2^bits buckets. Large tables are allocated with vmalloc. */
+static struct conn_hash * alloc_conn_hash(unsigned int bits){
+    size_t size = sizeof(struct conn_hash) + (sizeof(struct hlist_head) << bits);
+    struct conn_hash *table = (size <= PAGE_SIZE) ? kzalloc(size, GFP_KERNEL) : vzalloc(size);
+    if (table)
+        table->bits = bits;
+    return table;
+}
+
+/* free a table allocated by alloc_conn_hash */
+static void free_conn_hash(struct conn_hash *table){
+    if (is_vmalloc_addr(table))
+        vfree(table);
+    else
+        kfree(table);
+}
+
+/* lock the lock guarding the bucket of a given hash and return it.
+ * If a resize currently owns all the locks, wait for it to finish.
+ */
+static spinlock_t * conn_lock(u32 hash){
+    spinlock_t *lock = &conn_locks[hash & (CONN_LOCKS - 1)];
+    spin_lock_bh(lock);
+    if (likely(!ACCESS_ONCE(conn_locks_all)))
+        return lock;
+    spin_unlock_bh(lock);
+    spin_lock_bh(&conn_locks_all_lock); // wait for the resize to finish
+    spin_lock(lock);
+    spin_unlock(&conn_locks_all_lock); // bh stays disabled until the caller unlocks
+    return lock;
+}
+
+/* take ownership of all the bucket locks, waiting for current holders to finish */
+static void conn_lock_all(void){
+    int i;
+    spin_lock_bh(&conn_locks_all_lock);
+    conn_locks_all = 1;
+    smp_mb();
+    for (i = 0; i < CONN_LOCKS; ++i){
+        spin_lock(&conn_locks[i]);
+        spin_unlock(&conn_locks[i]);
+    }
+}
+
+/* release all the bucket locks */
+static void conn_unlock_all(void){
+    smp_mb();
+    conn_locks_all = 0;
+    spin_unlock_bh(&conn_locks_all_lock);
+}
+
+/* get the current table while holding a bucket lock, which blocks resizing */
+static struct conn_hash * locked_conn_table(void){
+    return rcu_dereference_protected(conn_table, 1);
+}
+
+/* check if a connection matches a 4-tuple, in either direction */
+static int con_match(connection *con, __be32 src_ip, __be16 src_port, __be32 dst_ip, __be16 dst_port){
+    return ((con->src_ip == src_ip && con->src_port == src_port &&
+             con->dst_ip == dst_ip && con->dst_port == dst_port) ||
+            (con->src_ip == dst_ip && con->src_port == dst_port && //reverse direction = same connection
+             con->dst_ip == src_ip && con->dst_port == src_port));
+}
+
+/* free a connection after all readers are done with it */
+static void free_con_rcu(struct rcu_head *head){
+    connection *con = container_of(head, connection, rcu);
+    release_dpi(con);
+    release_ftp_expects(con);
+    kmem_cache_free(conn_cache, con);
+}
+
+/* removes a connection from the connection table and frees its memory once
+ * all readers are done with it. Must be called with the connection's lock held.
+ */
 static void del_con(connection * con){
-    list_del(&con->list);
-    kfree(con);
+    hlist_del_init_rcu(&con->node); // leave the chain intact for readers, mark as unhashed for writers
+    atomic_dec(&conn_count);
+    call_rcu(&con->rcu, free_con_rcu);
 }
 
-/* locate a connection in the connection table or return NULL if a match does not exist */
-static connection * find_connection(__be32 src_ip, __be16 src_port, __be32 dst_ip, __be16 dst_port){
-    connection *cur, *tmp;
-    unsigned long expiry = get_seconds() - TIMEOUT; //timestamp for expiring timed out connections
-    unsigned long stale = get_seconds() - TIMEOUT*10; //timestamp for expiring stale connections
-    list_for_each_entry_safe(cur, tmp, &conn_table, list){
-        //remove any old connections in the handshake stage, inactive ftp data, or closed connections
-        if (((cur->src_state == C_SYN_SENT || cur->src_state == C_FTP_DATA) && cur->timestamp < expiry)
-            || cur->src_state == C_CLOSED || cur->dst_state == C_CLOSED || cur->timestamp < stale){
+/* get the timeout for a connection according to its state */
+static unsigned int con_timeout(connection *con){
+    switch (con->src_state){
+    case C_SYN_SENT:
+        return handshake_timeout;
+    case C_ESTABLISHED:
+        return established_timeout;
+    default: // one of the closing states
+        return closing_timeout;
+    }
+}
+
+/* check if a connection should be removed - it is closed or timed out.
+ * A connection that stopped in the middle of an inspected line times out
+ * early, so it doesn't hold the line's buffer. Its buffer can't be released
+ * while it lives, as the rest of the line couldn't be checked without it.
+ * Expired connections are ignored by lookups until they are removed by the gc.
+ */
+static int con_expired(connection *con, unsigned long now){
+    return (con->src_state == C_CLOSED || con->dst_state == C_CLOSED ||
+            now - con->timestamp > con_timeout(con) ||
+            (ACCESS_ONCE(con->dpi) && now - con->timestamp > DPI_BUF_IDLE_TIMEOUT));
+}
+
+/* remove all the expired connections in a bucket. Must be called with the bucket's lock held. */
+static void expire_bucket(struct hlist_head *head, unsigned long now){
+    connection *cur;
+    struct hlist_node *tmp;
+    hlist_for_each_entry_safe(cur, tmp, head, node){
+        if (con_expired(cur, now)){
+            conn_event(CONN_EVENT_EXPIRED, cur);
             del_con(cur);
-            continue;
         }
-        if ((cur->src_ip == src_ip && cur->src_port == src_port &&
-             cur->dst_ip == dst_ip && cur->dst_port == dst_port) ||
-            (cur->src_ip == dst_ip && cur->src_port == dst_port && //reverse direction = same connection
-             cur->dst_ip == src_ip && cur->dst_port == src_port))
-            return cur;
     }
-    return NULL;
 }
 
-/* add an ftp data connection to the connection table, based on what was found in
- * and existing ftp connection. If the PORT command contains invalid parameters
- * or an IP different then the client's - block it (by not adding it to the table).
- * PORT is always sent by the client, which is ftp->src, and the server will always
- * be ftp->dst.
+/* check if a connection is an established connection that saw recent traffic,
+ * these are the last to be evicted when the table is full.
  */
-static __u8 ftp_handler(connection *ftp){
-    __be32 src_ip   = 0;
-    __be16 src_port = 0;
-    unsigned char tmp[6]; //will be used to parse the ip and port
-    connection *con;
+static int con_protected(connection *con, unsigned long now){
+    return con->src_state == C_ESTABLISHED && now - con->timestamp < CONN_PROTECT_TIME;
+}
 
-    if (strstr(ftp->buffer, "PORT ") == NULL) //no port command in current buffer
-        return NF_ACCEPT;
+/* evict a connection near the bucket of hash to make room for a new connection.
+ * Expired connections and connections in the handshake stage are evicted first,
+ * otherwise the connection that was idle the longest, unless it is protected.
+ * returns 1 if a connection was evicted, 0 otherwise.
+ */
+static int early_drop(u32 hash){
+    connection *cur, *victim = NULL;
+    unsigned long now = get_seconds();
+    spinlock_t *lock;
+    int i, evicted = 0;
+    rcu_read_lock(); // keep the victim alive between the scan and the removal
+    for (i = 0; i < CONN_EARLY_DROP_BUCKETS; ++i){
+        lock = conn_lock(hash + i); // neighbouring buckets are guarded by neighbouring locks
+        hlist_for_each_entry(cur, conn_bucket(locked_conn_table(), hash + i), node){
+            if (con_expired(cur, now) || cur->src_state == C_SYN_SENT){ //the best victim, no need to look further
+                conn_event(CONN_EVENT_EVICTED, cur);
+                del_con(cur);
+                spin_unlock_bh(lock);
+                evicted = 1;
+                goto out;
+            }
+            if (!con_protected(cur, now) && (!victim || time_before(cur->timestamp, victim->timestamp)))
+                victim = cur;
+        }
+        spin_unlock_bh(lock);
+    }
+    if (victim){
+        lock = conn_lock(victim->hash);
+        if (!hlist_unhashed(&victim->node)){ //make sure no one removed it since we unlocked
+            conn_event(CONN_EVENT_EVICTED, victim);
+            del_con(victim);
+            evicted = 1;
+        }
+        spin_unlock_bh(lock);
+    }
+out:
+    rcu_read_unlock();
+    if (evicted)
+        atomic_inc(&conn_evictions);
+    return evicted;
+}
 
-    if (sscanf(ftp->buffer, "PORT %hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
-               &tmp[0], &tmp[1], &tmp[2], &tmp[3], &tmp[4], &tmp[5]) != 6){
-        printk(KERN_NOTICE "Bad PORT string: %s\n", ftp->buffer);
-        ftp->buffer[0] = '\0';
-        return NF_DROP;
+/* allocate a new connection for the given tuple. Only the tuple, its hash and
+ * the cold fields are initialized. If the table is full, try to evict another
+ * connection first. returns NULL if there is no room or no memory.
+ */
+static connection * alloc_con(__be32 src_ip, __be16 src_port, __be32 dst_ip, __be16 dst_port){
+    u32 hash = hash_tuple(src_ip, src_port, dst_ip, dst_port);
+    connection *con;
+    if (atomic_read(&conn_count) >= conn_max && !early_drop(hash)){
+        atomic_inc(&conn_insert_failures);
+        return NULL;
     }
-    ftp->buffer[0] = '\0';
+    con = kmem_cache_alloc(conn_cache, GFP_ATOMIC);
+    if (!con){
+        printk(KERN_ERR "Error allocating memory for connection.\n");
+        atomic_inc(&conn_insert_failures);
+        return NULL;
+    }
+    con->src_ip   = src_ip;
+    con->src_port = src_port;
+    con->dst_ip   = dst_ip;
+    con->dst_port = dst_port;
+    con->hash     = hash;
+    con->created  = get_seconds();
+    atomic64_set(&con->packets, 0);
+    atomic64_set(&con->bytes, 0);
+    spin_lock_init(&con->dpi_lock);
+    con->dpi = NULL;
+    con->dpi_done = 0;
+    con->dpi_id = dpi_port_id(dst_port);
+    con->dpi_seq = 0;
+    con->dpi_read = 0;
+    con->dpi_left = 0;
+    con->dpi_length = 0;
+    con->dpi_state = 0;
+    con->dpi_cr = 0;
+    con->dpi_segs_len = 0;
+    con->dpi_segs = NULL;
+    INIT_HLIST_HEAD(&con->ftp_expects);
+    con->ftp_expect_count = 0;
+    return con;
+}
 
-    //some bit magic to get those numbers into the correct vars
-    src_ip = (tmp[3] << 24) | (tmp[2]<<16) | (tmp[1]<<8) | tmp[0]; //net order is big-endian
-    src_port = (tmp[5] << 8) | tmp[4];
+/* get the table size (in bits) that fits the current number of connections */
+static unsigned int conn_table_bits(unsigned int bits){
+    unsigned int count = atomic_read(&conn_count);
+    while (count > (1U << bits) && bits < CONN_HASH_MAX_BITS)
+        ++bits;
+    while (count < (1U << bits) / 4 && bits > CONN_HASH_MIN_BITS)
+        --bits;
+    return bits;
+}
 
+/* move all connections to a new table with a size fitting the number of connections.
+ * If we can't allocate the new table we just keep the current one, and will
+ * try again on the next insert or gc run.
+ */
+static void resize_conn_table(struct work_struct *work){
+    struct conn_hash *old_table = rcu_dereference_protected(conn_table, 1); // only we replace the table
+    struct conn_hash *new_table;
+    unsigned int bits = conn_table_bits(old_table->bits);
+    connection *cur;
+    struct hlist_node *tmp;
+    unsigned int i;
+    if (bits == old_table->bits)
+        return;
+    new_table = alloc_conn_hash(bits);
+    if (!new_table)
+        return;
 #ifdef DEBUG
-    printk(KERN_DEBUG "Parsed ftp PORT: ip %pI4 port %u\n", &src_ip, ntohs(src_port));
+    printk(KERN_DEBUG "resizing conn_tab from %u to %u buckets\n", 1U << old_table->bits, 1U << bits);
 #endif
-    //make sure the client didn't spoof a different ip to gain an exception to the fw
-    if (src_ip != ftp->src_ip){
-        printk(KERN_NOTICE "Non matching ip in port command: client is %pI4 but passed %pI4\n",
-            &ftp->src_ip, &src_ip);
-        return NF_DROP;
+    conn_lock_all();
+    write_seqcount_begin(&conn_resize_seq);
+    for (i = 0; i < (1U << old_table->bits); ++i){
+        hlist_for_each_entry_safe(cur, tmp, &old_table->buckets[i], node){
+            hlist_del_rcu(&cur->node);
+            hlist_add_head_rcu(&cur->node, conn_bucket(new_table, cur->hash));
+        }
     }
+    rcu_assign_pointer(conn_table, new_table);
+    write_seqcount_end(&conn_resize_seq);
+    conn_unlock_all();
+    synchronize_rcu(); // wait for readers of the old table before freeing it
+    free_conn_hash(old_table);
+}
 
-    con = find_connection(src_ip, src_port, ftp->dst_ip, htons(20));
-    if (con) // don't add duplicates
-        return NF_ACCEPT;
-#ifdef DEBUG
-    printk(KERN_DEBUG "New ftp data connection: src %pI4:%u dst %pI4:20\n", &src_ip, ntohs(src_port), &ftp->dst_ip);
-#endif
-    con = kmalloc(sizeof(connection), GFP_ATOMIC);
-    if (!con){
-        printk(KERN_ERR "Error allocating memory for connection.\n");
-        return NF_DROP; //so sender will try again
-    }
-    con->timestamp = get_seconds();
-    con->src_ip    = src_ip;
-    con->src_port  = src_port;
-    con->dst_ip    = ftp->dst_ip;
-    con->dst_port  = htons(20);
-    con->src_state = con->dst_state = C_FTP_DATA;
-    con->buffer[0] = '\0'; // not really needed here
-    list_add(&con->list, &conn_table);
-    return NF_ACCEPT;
-}
-
-/* check if a string contains C code using several common patterns */
-static int is_c_code(const char * str){
-    if (strstr(str, "#include ") || strstr(str, "#define ") || strstr(str, "#ifdef ") ||
-        strstr(str, "int main(") || strstr(str, "void main(") || strstr(str, "return 0;") ||
-        strstr(str, "printf(\"") || strstr(str, "malloc(") || strstr(str, "return;"))
-        return 1;
-    return 0;
+static DECLARE_WORK(resize_work, resize_conn_table);
+
+/* schedule a resize if the table is too crowded or too empty, so chains stay short */
+static void maybe_resize_conn_table(void){
+    unsigned int bits;
+    rcu_read_lock();
+    bits = rcu_dereference(conn_table)->bits;
+    rcu_read_unlock();
+    if (conn_table_bits(bits) != bits)
+        schedule_work(&resize_work);
 }
 
-/* check if a sting contains any of the vulnerable CPG strings with illegal values */
-static int check_cpg(const char * buf){
-    char * res = NULL;
-    int i;
-    res = strstr(buf, "angle=");
-    if (res){
-        for (i = 6; res[i] != '\0' && res[i] != '\r' && res[i] != '&'; i++){
-            if (!isdigit(res[i]))
-                return 1;
-        }
-    }
-    res = strstr(buf, "rotate=");
-    if (res){
-        for (i = 7; res[i] != '\0' && res[i] != '\r' && res[i] != '&'; i++){
-            if (!isdigit(res[i]))
-                return 1;
-        }
-    }
-    res = strstr(buf, "clipval=");
-    if (res){
-        for (i = 8; res[i] != '\0' && res[i] != '\r' && res[i] != '&'; i++){
-            if (!isdigit(res[i]) && res[i] != ',') //clipval can also contain ,
-                return 1;
+/* add a connection to the table, unless a live connection with the same tuple
+ * is already there. Returns 0 on success or -EEXIST for duplicates, in which
+ * case the caller still owns the connection.
+ */
+static int add_con(connection * con){
+    connection *cur;
+    struct hlist_head *head;
+    unsigned long now = get_seconds();
+    spinlock_t *lock = conn_lock(con->hash);
+    head = conn_bucket(locked_conn_table(), con->hash);
+    hlist_for_each_entry(cur, head, node){
+        if (!con_expired(cur, now) && con_match(cur, con->src_ip, con->src_port, con->dst_ip, con->dst_port)){
+            spin_unlock_bh(lock);
+            return -EEXIST;
         }
     }
+    hlist_add_head_rcu(&con->node, head);
+    atomic_inc(&conn_count);
+    conn_event(CONN_EVENT_NEW, con);
+    spin_unlock_bh(lock);
+    maybe_resize_conn_table();
     return 0;
 }
 
-/* Check http packets for:
- * Blocked hosts
- * PHP File Manager vulnerability
- * Coppermine Photo Gallery vulnerability
- * C code leaks
+/* locate a connection in the connection table or return NULL if a match does not exist.
+ * Expired connections are skipped but never removed here, this is left to the gc.
+ * Must be called under rcu_read_lock(), the connection is only valid until it is released.
  */
-static __u8 http_handler(connection * con){
-    char * res = NULL;
-    //check for blocked hosts
-    res = strstr(con->buffer, "Host: ");
-    if (res != NULL){
-        if (check_hosts(res + 6)){
-            printk(KERN_NOTICE "Blocked Host: %s\n", res+6);
-            return NF_DROP;
+static connection * find_connection(__be32 src_ip, __be16 src_port, __be32 dst_ip, __be16 dst_port){
+    connection *cur;
+    unsigned long now = get_seconds();
+    u32 hash = hash_tuple(src_ip, src_port, dst_ip, dst_port);
+    unsigned int seq;
+    do {
+        seq = read_seqcount_begin(&conn_resize_seq);
+        hlist_for_each_entry_rcu(cur, conn_bucket(rcu_dereference(conn_table), hash), node){
+            if (!con_expired(cur, now) && con_match(cur, src_ip, src_port, dst_ip, dst_port))
+                return cur;
         }
-        return NF_ACCEPT;
-    }
+    } while (read_seqcount_retry(&conn_resize_seq, seq)); // we may have missed connections that were moving
+    return NULL;
+}
 
-    //check for php file manager vulnerability
-    if (strstr(con->buffer, "index.php?") && strstr(con->buffer, "action=6") ){
-        printk(KERN_NOTICE "Blocked PHP File Manager exploit attempt: %s\n", con->buffer);
-        return NF_DROP;
-    }
+/* SYN flood protection */
+/************************/
 
-    //check for Coppermine Photo Gallery vulnerability
-    if (check_cpg(con->buffer)){
-        printk(KERN_NOTICE "Blocked Coppermine Photo Gallery exploit attempt: %s\n", con->buffer);
-        return NF_DROP;
-    }
+/* While protection is active, syns don't add connections. The handshake is
+ * tracked instead in a fixed table of half-open slots, indexed by the tuple
+ * hash. A new syn simply takes over its slot, so spoofed syns cost no memory
+ * and can only push each other out. The connection is added once the client
+ * acks the server's syn-ack, proving it is reachable at its source address.
+ * A slot is guarded by the lock of the buckets its hash maps to.
+ */
+struct syn_slot {
+    __be32 src_ip;
+    __be16 src_port;
+    __be32 dst_ip;
+    __be16 dst_port;
+    __u8 state; // C_CLOSED for a free slot, C_SYN_SENT after the syn, C_SYN_RECEIVED after the syn-ack
+    __u8 hooknum;
+    u32 hash;
+    u32 client_isn, server_isn; // initial sequence numbers of both sides
+    unsigned long timestamp;
+};
 
-    //scan for C code
-    if (is_c_code(con->buffer)){
-        printk(KERN_NOTICE "Blocked possible C code leak: %s\n", con->buffer);
-        return NF_DROP;
-    }
+static struct syn_slot *syn_slots; // the half-open slots, allocated once on init
+static syn_protect_t syn_protect; // protection mode - off, auto or always on
+static unsigned int syn_threshold; // in auto mode, protect when more connections are opened in a second
+static unsigned long syn_protect_until; // in auto mode, protection is active until this time
+static unsigned long half_open_second; // the second counted by half_open_rate
+static atomic_t half_open_rate; // number of connections opened in half_open_second
+static atomic_t stateless_syns; // number of syns handled without adding a connection
 
-    return NF_ACCEPT;
+/* check if syn flood protection is currently active */
+static int syn_protect_active(unsigned long now){
+    return syn_protect == SYN_PROTECT_ON ||
+           (syn_protect == SYN_PROTECT_AUTO && time_before(now, ACCESS_ONCE(syn_protect_until)));
 }
 
-/* prevent SMTP packets from leaking C code */
-static __u8 smtp_handler(connection * con){
-    //scan for C code
-    if (is_c_code(con->buffer)){
-        printk(KERN_NOTICE "Blocked possible C code leak: %s\n", con->buffer);
-        return NF_DROP;
+/* count a new half-open connection, and activate the protection for a while if
+ * the rate of new connections passed the threshold. The counter is reset
+ * without locking at the start of every second, so the rate is approximate.
+ */
+static void count_half_open(unsigned long now){
+    if (ACCESS_ONCE(half_open_second) != now){
+        half_open_second = now;
+        atomic_set(&half_open_rate, 0);
     }
+    if (atomic_inc_return(&half_open_rate) > syn_threshold)
+        syn_protect_until = now + SYN_PROTECT_HOLD;
+}
 
-    return NF_ACCEPT;
+/* get the half-open slot of a given hash */
+static struct syn_slot * get_syn_slot(u32 hash){
+    return &syn_slots[hash & (SYN_SLOTS - 1)];
 }
 
-/* read a packet line by line and check it is valid according to the handler function*/
-static __u8 parse_packet(connection * con, struct tcphdr *tcp_header,
-                         unsigned char *tail, __u8 (*handler)(connection *)){
-    unsigned char *data = (unsigned char *)((unsigned char *)tcp_header + (tcp_header->doff * 4));
-    int data_pos = 0;
-    int buf_pos = strnlen(con->buffer, CON_BUF_SIZE); // we may have leftovers from a previous fragment
-    int data_len = tail-data; //calculate tcp data length
-    __u8 res = NF_ACCEPT;
-#ifdef DEBUG
-    printk(KERN_DEBUG "parsing tcp packet, length %d:\n", data_len);
-#endif
-    for (data_pos = 0; data_pos < data_len; data_pos++){
-        //copy the data to the buffer one line at a time
-        while (data_pos < data_len && buf_pos < CON_BUF_SIZE-1 &&
-               data[data_pos] != '\r' && data[data_pos] != '\n' && data[data_pos] != '\0' ){
-            con->buffer[buf_pos++] = data[data_pos++];
+/* check if a slot holds a 4-tuple in the direction of the syn */
+static int syn_slot_match(struct syn_slot *slot, __be32 src_ip, __be16 src_port, __be32 dst_ip, __be16 dst_port){
+    return (slot->src_ip == src_ip && slot->src_port == src_port &&
+            slot->dst_ip == dst_ip && slot->dst_port == dst_port);
+}
+
+/* record a syn in its half-open slot instead of adding a connection */
+static void new_syn_slot(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, unsigned long now){
+    u32 hash = hash_tuple(pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port);
+    spinlock_t *lock = conn_lock(hash);
+    struct syn_slot *slot = get_syn_slot(hash);
+    if (slot->state != C_CLOSED && slot->client_isn == ntohl(tcp_header->seq) &&
+        syn_slot_match(slot, pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port)){
+        spin_unlock_bh(lock); // the same syn in the other hook or retransmitted, keep the handshake
+        return;
+    }
+    slot->src_ip     = pkt->src_ip;
+    slot->src_port   = pkt->src_port;
+    slot->dst_ip     = pkt->dst_ip;
+    slot->dst_port   = pkt->dst_port;
+    slot->state      = C_SYN_SENT;
+    slot->hooknum    = hooknum;
+    slot->hash       = hash;
+    slot->client_isn = ntohl(tcp_header->seq);
+    slot->timestamp  = now;
+    spin_unlock_bh(lock);
+    atomic_inc(&stateless_syns);
+    count_half_open(now);
+}
+
+/* check a packet that has no connection against its half-open slot. A valid
+ * syn-ack is accepted, and a valid final ack frees the slot and adds the
+ * connection as established.
+ * returns REASON_CONN_EXIST if the packet is part of a tracked handshake.
+ */
+static reason_t check_syn_slot(rule_t *pkt, struct tcphdr *tcp_header){
+    u32 hash = hash_tuple(pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port);
+    unsigned long now = get_seconds();
+    struct syn_slot *slot = get_syn_slot(hash);
+    struct syn_slot done;
+    int established = 0, valid = 0;
+    spinlock_t *lock;
+    connection *con;
+
+    if (ACCESS_ONCE(slot->state) == C_CLOSED || ACCESS_ONCE(slot->hash) != hash) //most packets stop here without locking
+        return REASON_CONN_NOT_EXIST;
+    lock = conn_lock(hash);
+    if (slot->state == C_CLOSED || slot->hash != hash || now - slot->timestamp > handshake_timeout){
+        spin_unlock_bh(lock);
+        return REASON_CONN_NOT_EXIST;
+    }
+    if (syn_slot_match(slot, pkt->dst_ip, pkt->dst_port, pkt->src_ip, pkt->src_port)){
+        //handshake stage 2 - the syn-ack must ack the client's syn. Allow the same syn-ack in the other hook or retransmitted
+        if (tcp_header->syn && ntohl(tcp_header->ack_seq) == slot->client_isn + 1 &&
+            (slot->state == C_SYN_SENT || ntohl(tcp_header->seq) == slot->server_isn)){
+            slot->server_isn = ntohl(tcp_header->seq);
+            slot->state = C_SYN_RECEIVED;
+            valid = 1;
         }
-        con->buffer[buf_pos] = '\0'; //ensure the buffer is null-terminated
-        if (data_pos == data_len) // whole packet copied, no new line found - continue to next fragment
-            break;
-        //if we have a whole line, check it
-        if (data[data_pos] == '\r' || data[data_pos] == '\n' || data[data_pos] == '\0'){
-            res = handler(con);
-            if (res == NF_DROP){
-                break;
-            }
-            buf_pos = 0; //clear the buffer for next line
-        } else if (buf_pos == CON_BUF_SIZE-1){ //buffer is full
-            res = handler(con); //check what we have so far so we don't miss anything
-            if (res == NF_DROP){
-                break;
-            }
-            //copy the last 20 chars to the start of the buffer and continue
-            strncpy(con->buffer, con->buffer + CON_BUF_SIZE - 20, 20);
-            buf_pos = 20; //clear the buffer except the 20 copied chars
+    } else if (syn_slot_match(slot, pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port)){
+        //handshake stage 3 - the ack must follow the client's syn and ack the server's syn-ack
+        if (!tcp_header->syn && slot->state == C_SYN_RECEIVED &&
+            ntohl(tcp_header->seq) == slot->client_isn + 1 && ntohl(tcp_header->ack_seq) == slot->server_isn + 1){
+            done = *slot;
+            slot->state = C_CLOSED; //free the slot
+            established = 1;
         }
-        con->buffer[buf_pos] = '\0'; //prepare for the next iteration
     }
-    return res;
+    spin_unlock_bh(lock);
+
+    if (established){ //the client proved it is reachable, add the connection
+        con = alloc_con(done.src_ip, done.src_port, done.dst_ip, done.dst_port);
+        if (!con)
+            return REASON_CONN_NOT_EXIST;
+        con->timestamp = now;
+        con->src_state = con->dst_state = C_ESTABLISHED;
+        con->hooknum   = done.hooknum;
+        con->dpi_seq   = done.client_isn + 1; //the client's data starts after its syn
+        if (add_con(con)) // already added, only the first is needed
+            kmem_cache_free(conn_cache, con);
+        else // we are under rcu_read_lock(), the connection can't be freed yet
+            conn_event(CONN_EVENT_ESTABLISHED, con);
+        valid = 1;
+#ifdef DEBUG
+        printk(KERN_DEBUG "New Conn after handshake: src %pI4:%u dst %pI4:%u\n", &done.src_ip, ntohs(done.src_port), &done.dst_ip, ntohs(done.dst_port));
+#endif
+    }
+    if (!valid)
+        return REASON_CONN_NOT_EXIST;
+    pkt->action = NF_ACCEPT;
+    return REASON_CONN_EXIST;
 }
 
-/* check if a given connection is permitted in the connection table
- * and update the connection state if it changed.
+/* count a packet of len bytes in the connection's traffic counters */
+static void con_account(connection *con, unsigned int len){
+    atomic64_inc(&con->packets);
+    atomic64_add(len, &con->bytes);
+}
+
+/* get the inspector of a packet of a connection, the one bound to it when it was added, or
+ * NULL if it isn't inspected. Data sent by the client is read as a stream, data sent by
+ * the server (reverse) only if the inspector checks replies.
+ */
+static struct dpi_inspector * con_inspector(connection *con, int reverse){
+    struct dpi_inspector *insp;
+    if (ACCESS_ONCE(con->dpi_done))
+        return NULL;
+    insp = dpi_get_inspector(con->dpi_id);
+    return (insp && reverse && !insp->reply_handler) ? NULL : insp;
+}
+
+/* update the state of a connection according to a packet that belongs to it.
  * Set the action on the packet according to the decision and return the reason.
- * Note: this function assumes that tcp_header->ack is true.
+ * If the packet data should be inspected, insp is set to the inspector, and
+ * reply is set if the data was sent by the server.
+ * Must be called with the connection's lock held.
  */
-reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, unsigned char *tail){
+static reason_t update_con_state(connection *con, rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum,
+                                 unsigned int len, struct dpi_inspector **insp, int *reply){
     int reverse; //is this packet in the direction of the initial packet or the reverse?
-    connection *con = find_connection(pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port);
-    if (NULL == con){ //non existing connection - drop the packet
-        pkt->action = NF_DROP;
-        return REASON_CONN_NOT_EXIST;
-    }
     pkt->action = NF_ACCEPT; //existing connection - default to accept
 
-    if (con->src_state != C_FTP_DATA && con->hooknum != hooknum) //don't check the same packet twice
+    if (con->hooknum != hooknum) //don't check the same packet twice
         return REASON_CONN_EXIST;
     con->timestamp = get_seconds(); //update the timestamp
+    con_account(con, len);
     reverse = (pkt->src_ip == con->dst_ip && pkt->src_port == con->dst_port &&
                pkt->dst_ip == con->src_ip && pkt->dst_port == con->src_port);
 
@@ -256,10 +558,11 @@ reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hoo
         //handshake stage 3
         if (!reverse && con->dst_state == C_SYN_RECEIVED && !tcp_header->syn){
             con->src_state = con->dst_state = C_ESTABLISHED;
+            conn_event(CONN_EVENT_ESTABLISHED, con);
             return REASON_CONN_EXIST;
         }
     }
-    if (con->src_state != C_FTP_DATA && tcp_header->syn){ //syn is valid only during handshake, drop otherwise
+    if (tcp_header->syn){ //syn is valid only during handshake, drop otherwise
         pkt->action = NF_DROP;
 #ifdef DEBUG
         printk(KERN_DEBUG "Dropped packet, unexpected syn\n");
@@ -268,7 +571,7 @@ reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hoo
     }
 
     // in established connection
-    if (con->src_state == C_ESTABLISHED || con->src_state == C_FTP_DATA) {
+    if (con->src_state == C_ESTABLISHED) {
         if (tcp_header->fin){ //handle close requests
             if (reverse){ //the server requested the close
                 con->src_state = C_CLOSE_WAIT;
@@ -277,16 +580,9 @@ reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hoo
                 con->src_state = C_FIN_WAIT_1;
                 con->dst_state = C_CLOSE_WAIT;
             }
-        } else if (pkt->dst_port == htons(80)){ //scan http connections for blocked hosts & vulnerabilities
-            pkt->action = parse_packet(con, tcp_header, tail, http_handler);
-        } else if (pkt->dst_port == htons(21)){ //scan ftp connections for PORT commands
-            pkt->action = parse_packet(con, tcp_header, tail, ftp_handler);
-        } else if (pkt->dst_port == htons(25)){ //scan smtp connections for C code leaks
-            pkt->action = parse_packet(con, tcp_header, tail, smtp_handler);
-        }
-        if (pkt->action == NF_DROP){ //close the connection for bad hosts
-            con->src_state = con->dst_state = C_CLOSED;
-            return REASON_BLOCKED_HOST;
+        } else {
+            *insp = con_inspector(con, reverse);
+            *reply = reverse;
         }
         //any packet is valid now (we already made sure syn=0, ack=1)
         return REASON_CONN_EXIST;
@@ -330,37 +626,167 @@ reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hoo
     return REASON_CONN_EXIST;
 }
 
-/* Add a new connection to the connection table */
-void new_connection(rule_t pkt, unsigned int hooknum){
-    connection *con = find_connection(pkt.src_ip, pkt.src_port, pkt.dst_ip, pkt.dst_port);
-    if (con) // don't add duplicates
+/* Fast path for packets of established connections whose data is not
+ * inspected, or that used up their inspection budget - most of the traffic. The connection is only looked up and its
+ * timestamp and counters touched, without taking any lock. Packets that may
+ * change the connection state (syn, fin) or need inspection are left for
+ * check_conn_tab.
+ * returns 1 if the packet belongs to such a connection and is accepted, 0 otherwise.
+ */
+int conn_fast_path(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, unsigned int len){
+    __be16 src_port = tcp_header->source, dst_port = tcp_header->dest;
+    connection *con;
+    int accepted = 0;
+    if (!tcp_header->ack || tcp_header->syn || tcp_header->fin)
+        return 0;
+    rcu_read_lock();
+    con = find_connection(pkt->src_ip, src_port, pkt->dst_ip, dst_port);
+    if (con && con->src_state == C_ESTABLISHED &&
+        !con_inspector(con, pkt->src_ip == con->dst_ip && src_port == con->dst_port)){
+        if (con->hooknum == hooknum){ //only count the packet once
+            con->timestamp = get_seconds();
+            con_account(con, len);
+        }
+        accepted = 1;
+    }
+    rcu_read_unlock();
+    return accepted;
+}
+
+/* check if a given connection is permitted in the connection table
+ * and update the connection state if it changed.
+ * Set the action on the packet according to the decision and return the reason.
+ * The packet's data starts data_off bytes into the skb.
+ * Note: this function assumes that tcp_header->ack is true.
+ */
+reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, struct sk_buff *skb, unsigned int data_off){
+    reason_t reason = REASON_CONN_NOT_EXIST;
+    struct dpi_inspector *insp = NULL;
+    int reply = 0;
+    spinlock_t *lock;
+    connection *con;
+
+    pkt->action = NF_DROP; //non existing connection - drop the packet
+    rcu_read_lock();
+    con = find_connection(pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port);
+    if (!con){ //the handshake may be tracked in a half-open slot
+        reason = check_syn_slot(pkt, tcp_header);
+        if (reason == REASON_CONN_EXIST && !tcp_header->syn) //the final ack added the connection, its data is inspected as usual
+            con = find_connection(pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port);
+    }
+    if (con){
+        lock = conn_lock(con->hash);
+        if (!hlist_unhashed(&con->node)) //make sure the gc didn't remove it after we found it
+            reason = update_con_state(con, pkt, tcp_header, hooknum, skb->len, &insp, &reply);
+        spin_unlock_bh(lock);
+    }
+    if (insp){ //inspect the data outside the bucket lock, the handler may add expectations
+        spin_lock_bh(&con->dpi_lock);
+        if (reply) //replies are checked packet by packet, without the stream state
+            pkt->action = parse_reply(con, skb, data_off, insp);
+        else
+            pkt->action = parse_packet(con, tcp_header, skb, data_off, insp);
+        spin_unlock_bh(&con->dpi_lock);
+        if (pkt->action == DPI_RETRY){ //only drop this packet, the sender will send it again
+            pkt->action = NF_DROP;
+        } else if (pkt->action == NF_DROP){ //close the connection for bad hosts
+            lock = conn_lock(con->hash);
+            con->src_state = con->dst_state = C_CLOSED;
+            conn_event(CONN_EVENT_BLOCKED, con);
+            spin_unlock_bh(lock);
+            reason = REASON_BLOCKED_HOST;
+        }
+    }
+    rcu_read_unlock();
+    return reason;
+}
+
+/* Add a connection in its first handshake stage, after its syn */
+static void add_handshake_con(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, unsigned long now){
+    connection *con = alloc_con(pkt->src_ip, pkt->src_port, pkt->dst_ip, pkt->dst_port);
+    if (!con)
+        return;
+    con->timestamp = now;
+    con->src_state = C_SYN_SENT; //handshake stage 1
+    con->dst_state = C_LISTEN; //assume the server is listening - will timeout if not
+    con->hooknum   = hooknum; //only capture a connection in one hook
+    con->dpi_seq   = ntohl(tcp_header->seq) + 1; //the client's data starts after its syn
+    if (add_con(con)){ // don't add duplicates
+        kmem_cache_free(conn_cache, con);
         return;
+    }
+    count_half_open(now);
 #ifdef DEBUG
-    printk(KERN_DEBUG "New Conn: src %pI4:%u dst %pI4:%u\n", &pkt.src_ip, ntohs(pkt.src_port), &pkt.dst_ip, ntohs(pkt.dst_port));
+    printk(KERN_DEBUG "New Conn: src %pI4:%u dst %pI4:%u\n", &pkt->src_ip, ntohs(pkt->src_port), &pkt->dst_ip, ntohs(pkt->dst_port));
 #endif
-    con = kmalloc(sizeof(connection), GFP_ATOMIC);
-    if (!con){
-        printk(KERN_ERR "Error allocating memory for connection.\n");
+}
+
+/* Add a new connection to the connection table, or to a half-open slot if
+ * syn flood protection is active.
+ */
+void new_connection(rule_t pkt, struct tcphdr *tcp_header, unsigned int hooknum){
+    unsigned long now = get_seconds();
+    if (syn_protect_active(now)){ //don't keep state before the client completes the handshake
+        new_syn_slot(&pkt, tcp_header, hooknum, now);
         return;
     }
-    con->timestamp = get_seconds();
-    con->src_ip    = pkt.src_ip;
-    con->src_port  = pkt.src_port;
-    con->dst_ip    = pkt.dst_ip;
-    con->dst_port  = pkt.dst_port;
-    con->src_state = C_SYN_SENT; //handshake stage 1
-    con->dst_state = C_LISTEN; //assume the server is listening - will timeout if not
-    con->hooknum   = hooknum; //only capture a connection in one hook
-    con->buffer[0] = '\0';
-    list_add(&con->list, &conn_table);
+    add_handshake_con(&pkt, tcp_header, hooknum, now);
+}
+
+/* Check if a syn opens an ftp data connection that was announced on its control
+ * connection. If so, accept it and track the new connection like any other - the
+ * syn is known to be wanted, so it isn't held back by syn flood protection.
+ * returns REASON_CONN_EXIST if the syn was expected, 0 otherwise.
+ */
+reason_t check_ftp_data_syn(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum){
+    if (!ftp_expect_match(pkt))
+        return 0;
+    add_handshake_con(pkt, tcp_header, hooknum, get_seconds()); //a retransmitted syn finds it there
+    pkt->action = NF_ACCEPT;
+    return REASON_CONN_EXIST;
 }
 
 /* clear the connection table and free it's memory*/
 static void clear_cons(void){
-    connection *cur, *tmp;
-    list_for_each_entry_safe(cur, tmp, &conn_table, list){
-        del_con(cur);
+    struct conn_hash *table;
+    connection *cur;
+    struct hlist_node *tmp;
+    unsigned int i;
+    conn_lock_all();
+    table = locked_conn_table();
+    for (i = 0; i < (1U << table->bits); ++i){
+        hlist_for_each_entry_safe(cur, tmp, &table->buckets[i], node){
+            del_con(cur);
+        }
+    }
+    conn_unlock_all();
+}
+
+/* Connection table garbage collection */
+/****************************************/
+
+static struct timer_list gc_timer;
+static unsigned int gc_bucket; // the next bucket to sweep for expired connections
+
+/* sweep the next batch of buckets for expired connections and rearm the timer */
+static void conn_gc(unsigned long data){
+    struct conn_hash *table;
+    unsigned int batch;
+    unsigned long now = get_seconds();
+    spinlock_t *lock;
+    rcu_read_lock();
+    batch = max((1U << rcu_dereference(conn_table)->bits) / CONN_GC_TICKS, 1U);
+    rcu_read_unlock();
+    while (batch--){
+        lock = conn_lock(gc_bucket); // a bucket is guarded by the lock of the hashes that map to it
+        table = locked_conn_table();
+        gc_bucket &= (1U << table->bits) - 1; // the table may have been resized since the last run
+        expire_bucket(&table->buckets[gc_bucket++], now);
+        spin_unlock_bh(lock);
     }
+    maybe_resize_conn_table(); //shrink the table if we removed enough connections
+    expire_ftp_expects(now);
+    mod_timer(&gc_timer, jiffies + CONN_GC_INTERVAL);
 }
 
 /* connection table char device functions and handlers */
@@ -368,58 +794,394 @@ static void clear_cons(void){
 
 static int major_number;
 static struct device *dev = NULL;
-static struct list_head *cur_con; // used for iterating the table during read
+
+/* The key a reader orders the connections of a bucket by. It doesn't change
+ * for the life of a connection.
+ */
+struct conn_key {
+    u32 hash;
+    __be32 src_ip, dst_ip;
+    __be16 src_port, dst_port;
+};
+
+/* The state of an open conn_tab device. Every open file reads the table with
+ * its own cursor - the bucket, and the key of the last connection read from it
+ * rather than a pointer or a position in the chain. A bucket is read in key
+ * order, so connections that are added to or removed from the chain between
+ * reads don't move the cursor: a connection that is in the table for the whole
+ * listing is read exactly once, while one added or removed during it may or may
+ * not be. If the table is resized during the listing connections move between
+ * buckets, and some rows may be skipped or repeated.
+ */
+struct conn_reader {
+    unsigned int bucket; // the bucket being read
+    int in_bucket; // some of the bucket was read, up to last
+    struct conn_key last; // the key of the last connection read
+    conn_filter_t filter; // only read the connections matching the filter
+    __be32 mask; // the network mask of filter.prefix_size
+    conn_record_t records[CONN_READ_BATCH]; // records are built here before they are copied to the user
+};
 
 /* open the connection table char device */
-static int open_cons(struct inode *_inode, struct file *_file){
+static int open_cons(struct inode *_inode, struct file *filp){
+    struct conn_reader *reader;
 #ifdef DEBUG
     printk(KERN_DEBUG "opened conn_tab\n");
 #endif
-    cur_con = conn_table.next; //reset the pointer to the first row
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL); //the cursor starts at the first row
+    if (!reader)
+        return -ENOMEM;
+    reader->filter.state = CONN_FILTER_ANY_STATE;
+    filp->private_data = reader;
+    return 0;
+}
+
+/* release the connection table char device */
+static int release_cons(struct inode *_inode, struct file *filp){
+    kfree(filp->private_data);
     return 0;
 }
 
-/* reads the connection table, one connection at a time */
+/* check if a connection matches the reader's filter */
+static int filter_con(struct conn_reader *reader, connection *con){
+    conn_filter_t *filter = &reader->filter;
+    if (filter->prefix_size && (con->src_ip & reader->mask) != filter->ip &&
+        (con->dst_ip & reader->mask) != filter->ip)
+        return 0;
+    if (filter->port != PORT_ANY && con->src_port != filter->port && con->dst_port != filter->port)
+        return 0;
+    if (filter->state != CONN_FILTER_ANY_STATE && con->src_state != filter->state && con->dst_state != filter->state)
+        return 0;
+    return 1;
+}
+
+/* fill the record of a connection */
+static void fill_record(conn_record_t *record, connection *con){
+    record->version   = CONN_RECORD_VERSION;
+    record->size      = CONN_RECORD_SIZE;
+    record->src_state = con->src_state;
+    record->dst_state = con->dst_state;
+    record->src_ip    = con->src_ip;
+    record->dst_ip    = con->dst_ip;
+    record->src_port  = con->src_port;
+    record->dst_port  = con->dst_port;
+    record->timestamp = con->timestamp;
+    record->packets   = atomic64_read(&con->packets);
+    record->bytes     = atomic64_read(&con->bytes);
+}
+
+/* get the key of a connection */
+static void get_con_key(connection *con, struct conn_key *key){
+    key->hash     = con->hash;
+    key->src_ip   = con->src_ip;
+    key->dst_ip   = con->dst_ip;
+    key->src_port = con->src_port;
+    key->dst_port = con->dst_port;
+}
+
+/* compare connection keys, for reading a bucket in order */
+static int cmp_con_key(const struct conn_key *a, const struct conn_key *b){
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    if (a->src_ip != b->src_ip)
+        return a->src_ip < b->src_ip ? -1 : 1;
+    if (a->dst_ip != b->dst_ip)
+        return a->dst_ip < b->dst_ip ? -1 : 1;
+    if (a->src_port != b->src_port)
+        return a->src_port < b->src_port ? -1 : 1;
+    return a->dst_port < b->dst_port ? -1 : a->dst_port > b->dst_port;
+}
+
+/* fill the reader's records with up to max connections from its cursor, and
+ * advance the cursor past them, visiting at most CONN_READ_BUCKETS buckets.
+ * returns the number of records filled, and sets end once the cursor reached
+ * the end of the table.
+ * Each step finds the matching connection with the next key in the bucket. The
+ * chains are kept short by resizing, so this costs little more than walking them.
+ */
+static size_t cursor_cons(struct conn_reader *reader, size_t max, unsigned long now, int *end){
+    struct conn_hash *table;
+    struct conn_key key, next_key;
+    connection *cur, *next;
+    size_t count = 0;
+    unsigned int visited = 0;
+    rcu_read_lock(); // the connections and the table can't be freed while we hold this
+    table = rcu_dereference(conn_table);
+    while (count < max && visited < CONN_READ_BUCKETS && reader->bucket < (1U << table->bits)){
+        next = NULL;
+        hlist_for_each_entry_rcu(cur, &table->buckets[reader->bucket], node){
+            //don't list connections waiting for the gc, or that don't match the filter
+            if (con_expired(cur, now) || !filter_con(reader, cur))
+                continue;
+            get_con_key(cur, &key);
+            if (reader->in_bucket && cmp_con_key(&key, &reader->last) <= 0) //already read
+                continue;
+            if (!next || cmp_con_key(&key, &next_key) < 0){
+                next = cur;
+                next_key = key;
+            }
+        }
+        if (!next){ //continue to the next bucket
+            ++reader->bucket;
+            reader->in_bucket = 0;
+            ++visited;
+            continue;
+        }
+        reader->last = next_key;
+        reader->in_bucket = 1;
+        fill_record(&reader->records[count++], next);
+    }
+    *end = reader->bucket >= (1U << table->bits);
+    rcu_read_unlock();
+    return count;
+}
+
+/* reads the connection table, as many whole records as fit in the buffer */
 static ssize_t read_cons(struct file *filp, char *buff, size_t length, loff_t *offp){
-    unsigned long expiry = get_seconds() - TIMEOUT*10; //expire very stale connections when listing
-    connection *tmp;
+    struct conn_reader *reader = filp->private_data;
+    size_t max = length / CONN_RECORD_SIZE, total = 0, count;
+    unsigned long now = get_seconds();
+    int end = 0;
 #ifdef DEBUG
-    printk(KERN_DEBUG "read cons, length: %d, row size: %d\n", length, CONNECTION_SIZE);
+    printk(KERN_DEBUG "read cons, length: %d, record size: %d\n", length, CONN_RECORD_SIZE);
 #endif
-    while (cur_con != &conn_table && list_entry(cur_con, connection, list)->timestamp < expiry){
-        tmp = list_entry(cur_con, connection, list);
-        cur_con = cur_con->next;
-        del_con(tmp);
-    }
-    if (cur_con == &conn_table){ //the table is empty or we reached the end
-        return 0;
-    }
-    if (length < CONNECTION_SIZE){ // length must be at least CONNECTION_SIZE for read to work, we don't send partial rows.
+    if (!max){ // length must be at least CONN_RECORD_SIZE for read to work, we don't send partial records.
         return -ENOMEM;
     }
+    while (total < max && !end){
+        // the records are built under rcu and copied after it, as copy_to_user may sleep
+        count = cursor_cons(reader, min_t(size_t, max - total, CONN_READ_BATCH), now, &end);
+        if (copy_to_user(buff + total * CONN_RECORD_SIZE, reader->records, count * CONN_RECORD_SIZE)){
+            return -EFAULT;
+        }
+        total += count;
+        cond_resched(); //a filter that matches few connections may take many batches
+    }
+    return total * CONN_RECORD_SIZE;
+}
 
-    if (copy_to_user(buff, list_entry(cur_con, connection, list), CONNECTION_SIZE)){  // Send the data to the user through 'copy_to_user'
+/* set the filter for reading the table, and restart reading from the first row */
+static ssize_t write_cons(struct file *filp, const char *buff, size_t length, loff_t *offp){
+    struct conn_reader *reader = filp->private_data;
+    conn_filter_t filter;
+    if (length != sizeof(filter)){ //bad size - only accept a single filter
+        return -EINVAL;
+    }
+    if (copy_from_user(&filter, buff, length)){
         return -EFAULT;
     }
-    cur_con = cur_con->next; //advance to the next connection for the next read
-    return CONNECTION_SIZE;
+    if (filter.prefix_size > 32){
+        return -EINVAL;
+    }
+#ifdef DEBUG
+    printk(KERN_DEBUG "conn_tab filter: %pI4/%u port %u state %u\n", &filter.ip, filter.prefix_size, ntohs(filter.port), filter.state);
+#endif
+    reader->mask = filter.prefix_size ? htonl(~0U << (32 - filter.prefix_size)) : 0;
+    filter.ip &= reader->mask;
+    reader->filter = filter;
+    reader->bucket = 0;
+    reader->in_bucket = 0;
+    return length;
 }
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = open_cons,
-    .read = read_cons
+    .release = release_cons,
+    .read = read_cons,
+    .write = write_cons
 };
 
+/* conn_tab sysfs functions and attributes */
+/*******************************************/
+
+/* get a timeout by the first letter of the attribute name */
+static unsigned int * get_timeout(char id){
+    switch (id){
+        case 'h': //handshake
+            return &handshake_timeout;
+        case 'f': //ftp data expectations
+            return &ftp_expect_timeout;
+        case 'e': //established
+            return &established_timeout;
+        case 'c': //closing
+            return &closing_timeout;
+    }
+    return NULL;
+}
+
+/* sysfs attribute to show a timeout */
+static ssize_t show_timeout(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%u\n", *get_timeout(attr->attr.name[0]));
+}
+
+/* sysfs attribute to set a timeout, in seconds */
+static ssize_t set_timeout(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    unsigned int temp;
+    if (sscanf(buf, "%u", &temp) == 1 && temp > 0){
+#ifdef DEBUG
+        printk(KERN_DEBUG "setting %s to %u\n", attr->attr.name, temp);
+#endif
+        *get_timeout(attr->attr.name[0]) = temp;
+    }
+    return count;
+}
+
+/* sysfs attribute to show the number of connections in the table */
+static ssize_t show_size(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&conn_count));
+}
+
+/* sysfs attribute to show the maximal number of connections */
+static ssize_t show_max(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%u\n", conn_max);
+}
+
+/* sysfs attribute to set the maximal number of connections */
+static ssize_t set_max(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    unsigned int temp;
+    if (sscanf(buf, "%u", &temp) == 1 && temp > 0){
+#ifdef DEBUG
+        printk(KERN_DEBUG "setting max connections to %u\n", temp);
+#endif
+        conn_max = temp;
+    }
+    return count;
+}
+
+/* sysfs attribute to show the number of evicted connections */
+static ssize_t show_evictions(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&conn_evictions));
+}
+
+/* sysfs attribute to show the number of connections we couldn't add */
+static ssize_t show_insert_failures(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&conn_insert_failures));
+}
+
+/* sysfs attribute to show the syn flood protection mode */
+static ssize_t show_syn_protect(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", syn_protect);
+}
+
+/* sysfs attribute to set the syn flood protection mode - 0 off, 1 auto, 2 always on */
+static ssize_t set_syn_protect(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    unsigned int temp;
+    if (sscanf(buf, "%u", &temp) == 1 && temp <= SYN_PROTECT_ON){
+#ifdef DEBUG
+        printk(KERN_DEBUG "setting syn flood protection to %u\n", temp);
+#endif
+        syn_protect = temp;
+    }
+    return count;
+}
+
+/* sysfs attribute to show if syn flood protection is currently active */
+static ssize_t show_syn_protect_active(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", syn_protect_active(get_seconds()));
+}
+
+/* sysfs attribute to show the rate of new connections that activates the protection in auto mode */
+static ssize_t show_syn_threshold(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%u\n", syn_threshold);
+}
+
+/* sysfs attribute to set the rate of new connections that activates the protection in auto mode */
+static ssize_t set_syn_threshold(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    unsigned int temp;
+    if (sscanf(buf, "%u", &temp) == 1 && temp > 0){
+#ifdef DEBUG
+        printk(KERN_DEBUG "setting syn threshold to %u\n", temp);
+#endif
+        syn_threshold = temp;
+    }
+    return count;
+}
+
+/* sysfs attribute to show the number of syns handled without adding a connection */
+static ssize_t show_stateless_syns(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&stateless_syns));
+}
+
+/* sysfs attribute to show the number of expected ftp data connections */
+static ssize_t show_ftp_expects(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", ftp_expects_count());
+}
+
+/* sysfs attributes */
+static struct device_attribute conn_attrs[]= {
+        __ATTR(handshake_timeout, S_IWUSR|S_IRUSR, show_timeout, set_timeout),
+        __ATTR(ftp_data_timeout, S_IWUSR|S_IRUSR, show_timeout, set_timeout),
+        __ATTR(established_timeout, S_IWUSR|S_IRUSR, show_timeout, set_timeout),
+        __ATTR(closing_timeout, S_IWUSR|S_IRUSR, show_timeout, set_timeout),
+        __ATTR(conn_tab_size, S_IRUSR, show_size, NULL),
+        __ATTR(max_conns, S_IWUSR|S_IRUSR, show_max, set_max),
+        __ATTR(evictions, S_IRUSR, show_evictions, NULL),
+        __ATTR(insert_failures, S_IRUSR, show_insert_failures, NULL),
+        __ATTR(syn_protect, S_IWUSR|S_IRUSR, show_syn_protect, set_syn_protect),
+        __ATTR(syn_protect_active, S_IRUSR, show_syn_protect_active, NULL),
+        __ATTR(syn_threshold, S_IWUSR|S_IRUSR, show_syn_threshold, set_syn_threshold),
+        __ATTR(stateless_syns, S_IRUSR, show_stateless_syns, NULL),
+        __ATTR(ftp_expects, S_IRUSR, show_ftp_expects, NULL),
+        __ATTR_NULL // stopping condition for loop in device_add_attributes()
+    };
+
 /* initialize the conn_tab module */
 int init_conn_tab(void){
+    struct conn_hash *table;
+    int i;
 #ifdef DEBUG
     printk(KERN_DEBUG "initializing conn_tab device\n");
 #endif
-    major_number = safe_device_init(DEVICE_NAME_CONN_TAB, &fops, dev, NULL);
-    // Since we use safe_device_init, in case of failure all cleanup will be
-    // handled already, only need to return 0 for non-negative major (=no error)
-    return (major_number < 0) ? major_number : 0;
+    BUILD_BUG_ON(offsetof(connection, rcu) > L1_CACHE_BYTES); //lookups should only touch one cache line
+    conn_cache = kmem_cache_create("fw_conn_tab", sizeof(connection), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (!conn_cache){
+        printk(KERN_ERR "Error creating connection cache.\n");
+        return -ENOMEM;
+    }
+    get_random_bytes(&conn_hash_rnd, sizeof(conn_hash_rnd));
+    table = alloc_conn_hash(CONN_HASH_MIN_BITS);
+    if (!table){
+        printk(KERN_ERR "Error allocating memory for connection table.\n");
+        kmem_cache_destroy(conn_cache);
+        return -ENOMEM;
+    }
+    syn_slots = vzalloc(sizeof(struct syn_slot) * SYN_SLOTS); // all slots start free (C_CLOSED)
+    if (!syn_slots){
+        printk(KERN_ERR "Error allocating memory for half-open slots.\n");
+        free_conn_hash(table);
+        kmem_cache_destroy(conn_cache);
+        return -ENOMEM;
+    }
+    RCU_INIT_POINTER(conn_table, table);
+    seqcount_init(&conn_resize_seq);
+    for (i = 0; i < CONN_LOCKS; ++i)
+        spin_lock_init(&conn_locks[i]);
+    atomic_set(&conn_count, 0);
+    atomic_set(&conn_evictions, 0);
+    atomic_set(&conn_insert_failures, 0);
+    conn_max = CONN_MAX;
+    handshake_timeout = TIMEOUT;
+    established_timeout = TIMEOUT_ESTABLISHED;
+    closing_timeout = TIMEOUT_CLOSING;
+    syn_protect = SYN_PROTECT_AUTO;
+    syn_threshold = SYN_THRESHOLD;
+    syn_protect_until = half_open_second = 0;
+    atomic_set(&half_open_rate, 0);
+    atomic_set(&stateless_syns, 0);
+    major_number = safe_device_init(DEVICE_NAME_CONN_TAB, &fops, dev, conn_attrs);
+    // Since we use safe_device_init, in case of failure all device cleanup will be
+    // handled already, we only need to release the tables and the cache
+    if (major_number < 0){
+        vfree(syn_slots);
+        free_conn_hash(table);
+        kmem_cache_destroy(conn_cache);
+        return major_number;
+    }
+    gc_bucket = 0;
+    setup_timer(&gc_timer, conn_gc, 0);
+    mod_timer(&gc_timer, jiffies + CONN_GC_INTERVAL);
+    return 0;
 }
 
 /* cleanup the conn_tab module */
@@ -427,6 +1189,12 @@ void cleanup_conn_tab(void){
 #ifdef DEBUG
     printk(KERN_DEBUG "Cleaning up conn_tab device\n");
 #endif
-    safe_device_cleanup(major_number, 3, dev, NULL);
+    del_timer_sync(&gc_timer);
+    cancel_work_sync(&resize_work);
+    safe_device_cleanup(major_number, 3, dev, conn_attrs);
     clear_cons();
+    free_conn_hash(rcu_dereference_protected(conn_table, 1));
+    vfree(syn_slots);
+    rcu_barrier(); // wait for all pending frees before destroying the cache
+    kmem_cache_destroy(conn_cache);
 }
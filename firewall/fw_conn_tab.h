@@ -3,7 +3,10 @@
 
 #define DEVICE_NAME_CONN_TAB        "conn_tab"
 
-/* Possible TCP states + a special state for FTP data connections */
+/* Possible TCP states + a special state for FTP data connections.
+ * FTP data connections are now tracked as regular connections once their
+ * expectation is met, C_FTP_DATA is kept for the record format.
+ */
 typedef enum {
     C_CLOSED,
     C_LISTEN,
@@ -19,13 +22,14 @@ typedef enum {
     C_FTP_DATA
 } conn_state;
 
-#define CON_BUF_SIZE 256 //use 256 bytes to provide a decent buffer but not too long
-
 /* struct representing a connection.
  * Note - this represents both directions as any connection is uniquely identified
  * by the tuple of ips and ports.
  * src represents the initiator (usually the client)
  * dst represents the responder (usually the server)
+ *
+ * The fields used by lookups and state tracking are packed in the first cache
+ * line, cold data used only for inspection and freeing starts on the next one.
  */
 typedef struct {
     __be32 src_ip;
@@ -34,26 +38,131 @@ typedef struct {
     __be16 dst_port;
     char src_state; // the state we assume the client is in
     char dst_state; // the state we assume the server is in
+    __u8 hooknum; // make sure we only capture in one hook - for fwd packets
+    __u8 dpi_done; // the inspection budget is used up, the data is no longer inspected
+    __u8 dpi_id; // the inspector of the connection's data, by its port when it was added
+    u32 hash; // the hash of the connection tuple, also selects the lock guarding it
     unsigned long timestamp; //last packet seen - for timeout calculations
-    unsigned int hooknum; // make sure we only capture in one hook - for fwd packets
-    char buffer[CON_BUF_SIZE]; //buffer for reading the connection data,
-    struct list_head list;
+    struct hlist_node node; // chain in the connection hash table
+    atomic64_t packets, bytes; // traffic counters, for both directions
+    /* cold data */
+    struct rcu_head rcu ____cacheline_aligned_in_smp; // used for freeing the connection after all readers are done with it
+    unsigned long created; // time the connection was added - for events
+    spinlock_t dpi_lock; // guards the inspection buffer and stream
+    struct dpi_buf *dpi; // buffer for reading the connection data, only attached while inspecting a line
+    u32 dpi_seq; // sequence number of the next byte of the inspected stream
+    unsigned int dpi_read; // number of bytes inspected so far, counted against the budget
+    u32 dpi_left; // bytes left of a length-delimited part of the stream, like an http body
+    u32 dpi_length; // length of the next part, while the headers before it are parsed
+    __u8 dpi_state; // state of the inspector's protocol parser
+    __u8 dpi_cr; // the last line ended with '\r', so a '\n' right after it ends the same line
+    unsigned int dpi_segs_len; // number of bytes held in dpi_segs
+    struct dpi_seg *dpi_segs; // out of order segments waiting for the data before them, by sequence number
+    struct hlist_head ftp_expects; // the data connections an ftp control connection expects
+    __u8 ftp_expect_count; // number of entries in ftp_expects
 } connection;
 
-//CONNECTION_SIZE is defined to only include fields that are sent to the userspace.
-#define CONNECTION_SIZE (sizeof(connection)-sizeof(long)-sizeof(int)-sizeof(char)*CON_BUF_SIZE-sizeof(struct list_head))
-/* The time to remove a connection if handshake has not been completed or ftp data
- * transfer has been inactive.
- * 10 times this is used to indicate a stale connection that should be closed.
+/* The record of a connection as read from the conn_tab device. The layout is
+ * fixed and does not depend on the connection struct - any change to it must
+ * bump CONN_RECORD_VERSION, and fields may only be added at the end.
+ */
+#define CONN_RECORD_VERSION 2
+typedef struct {
+    __u8   version;   // CONN_RECORD_VERSION
+    __u8   size;      // the record size, CONN_RECORD_SIZE
+    __u8   src_state; // values from conn_state
+    __u8   dst_state;
+    __be32 src_ip;
+    __be32 dst_ip;
+    __be16 src_port;
+    __be16 dst_port;
+    __u32  timestamp; // last packet seen, in seconds
+    __u64  packets;   // packets seen in both directions, since version 2
+    __u64  bytes;     // bytes seen in both directions, since version 2
+} __attribute__((packed)) conn_record_t;
+
+#define CONN_RECORD_SIZE sizeof(conn_record_t)
+
+/* Filter for reading the conn_tab device, set by writing it to the open device.
+ * Only connections matching all the fields are read.
+ */
+#define CONN_FILTER_ANY_STATE 0xff
+typedef struct {
+    __be32 ip;          // either endpoint is in ip/prefix_size
+    __u8   prefix_size; // 0-32, 0 for any ip
+    __u8   state;       // either side is in this state, CONN_FILTER_ANY_STATE for any
+    __be16 port;        // either endpoint uses this port, PORT_ANY for any
+} __attribute__((packed)) conn_filter_t;
+
+/* Number of records copied to the user at a time on read */
+#define CONN_READ_BATCH 128
+/* Number of buckets a read visits under a single rcu_read_lock() */
+#define CONN_READ_BUCKETS 1024
+/* Default timeouts (in seconds) for removing inactive connections, by state.
+ * TIMEOUT is used for connections that did not complete the handshake.
+ * All timeouts can be changed through sysfs, as can the time ftp data
+ * connections are expected (ftp_data_timeout, see fw_expect.h).
  */
 #define TIMEOUT 25
+#define TIMEOUT_ESTABLISHED (TIMEOUT*10)
+#define TIMEOUT_CLOSING (TIMEOUT*10)
+
+/* Expired connections are removed in the background by a timer, that sweeps a
+ * batch of buckets every CONN_GC_INTERVAL so that the whole table is covered
+ * every CONN_GC_TICKS runs.
+ */
+#define CONN_GC_INTERVAL (HZ/10)
+#define CONN_GC_TICKS 20
+
+/* Size limits for the connection hash table, in bits (the table has 2^bits buckets).
+ * The table starts at the minimum size and doubles whenever there are more
+ * connections than buckets, and halves again when it is less than a quarter full.
+ */
+#define CONN_HASH_MIN_BITS 8
+#define CONN_HASH_MAX_BITS 20
+
+/* Default maximal number of connections in the table, can be changed through sysfs.
+ * When the table is full, a new connection evicts one of the connections in
+ * the CONN_EARLY_DROP_BUCKETS buckets starting at its own bucket. Established
+ * connections that saw traffic in the last CONN_PROTECT_TIME seconds are
+ * never evicted.
+ */
+#define CONN_MAX (1 << CONN_HASH_MAX_BITS)
+#define CONN_EARLY_DROP_BUCKETS 8
+#define CONN_PROTECT_TIME 10
+
+/* Number of locks guarding the connection table buckets and connection states.
+ * Must be a power of 2, no larger than the minimal table size.
+ */
+#define CONN_LOCKS 256
+
+/* SYN flood protection modes. While protection is active, a syn doesn't add a
+ * connection - the handshake is tracked in one of 2^SYN_SLOTS_BITS fixed
+ * half-open slots, and the connection is only added on the final ack.
+ * In auto mode protection is active for SYN_PROTECT_HOLD seconds whenever more
+ * than syn_threshold (default SYN_THRESHOLD) connections are opened in a second.
+ */
+typedef enum {
+    SYN_PROTECT_OFF  = 0,
+    SYN_PROTECT_AUTO = 1,
+    SYN_PROTECT_ON   = 2,
+} syn_protect_t;
+
+#define SYN_SLOTS_BITS 14
+#define SYN_SLOTS (1 << SYN_SLOTS_BITS)
+#define SYN_THRESHOLD 1000
+#define SYN_PROTECT_HOLD 10
 
 /* Connection table public interface */
 
+/* accept a packet of an established connection that needs no inspection, returns 1 if accepted */
+int conn_fast_path(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, unsigned int len);
 /* check if a packet matches an exisiting connection in the table */
-reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, unsigned char *tail);
-/* add a new connection */
-void new_connection(rule_t pkt, unsigned int hooknum);
+reason_t check_conn_tab(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum, struct sk_buff *skb, unsigned int data_off);
+/* add a new connection for an accepted syn */
+void new_connection(rule_t pkt, struct tcphdr *tcp_header, unsigned int hooknum);
+/* accept a syn of an expected ftp data connection, returns REASON_CONN_EXIST if it was expected */
+reason_t check_ftp_data_syn(rule_t *pkt, struct tcphdr *tcp_header, unsigned int hooknum);
 
 /*module init*/
 int init_conn_tab(void);
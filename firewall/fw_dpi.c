@@ -0,0 +1,1131 @@
+#include "fw.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Tomer Brisker");
+
+/*********************************
+ * Deep packet inspection module *
+ *********************************/
+
+/* Line buffer pool */
+/********************/
+
+// each size class has its own slab cache. Names must stay valid while the caches exist.
+static const char *dpi_cache_names[DPI_BUF_CLASSES] = { "fw_dpi_256", "fw_dpi_1024", "fw_dpi_4096" };
+static struct kmem_cache *dpi_caches[DPI_BUF_CLASSES];
+
+/* the number of chars a buffer of a given size class can hold */
+#define DPI_BUF_CHARS(size_class) ((DPI_BUF_MIN_SIZE << (2 * (size_class))) - sizeof(struct dpi_buf))
+
+/* get the number of chars a buffer of a given size class can hold */
+static unsigned int dpi_buf_size(__u8 size_class){
+    return DPI_BUF_CHARS(size_class);
+}
+
+/* replace a buffer with one from the next size class, keeping its first len chars.
+ * If buf is NULL a buffer from the smallest class is returned.
+ * Returns NULL if buf is already in the largest class or if we are out of memory,
+ * in which case buf is left untouched.
+ */
+static struct dpi_buf * grow_dpi_buf(struct dpi_buf *buf, unsigned int len){
+    __u8 size_class = buf ? buf->size_class + 1 : 0;
+    struct dpi_buf *new_buf;
+    if (size_class == DPI_BUF_CLASSES)
+        return NULL;
+    new_buf = kmem_cache_alloc(dpi_caches[size_class], GFP_ATOMIC | __GFP_NOWARN);
+    if (!new_buf)
+        return NULL;
+    new_buf->size_class = size_class;
+    new_buf->cut = 0;
+    if (buf){
+        memcpy(new_buf->data, buf->data, len);
+        kmem_cache_free(dpi_caches[buf->size_class], buf);
+    }
+    return new_buf;
+}
+
+/* return the connection's line buffer to the pool, if it has one */
+void release_dpi_buf(connection *con){
+    if (con->dpi){
+        kmem_cache_free(dpi_caches[con->dpi->size_class], con->dpi);
+        con->dpi = NULL;
+    }
+}
+
+/* Inspection handlers */
+/***********************/
+
+/* expect an active mode ftp data connection, based on what was found in an
+ * existing ftp connection. If the PORT command contains invalid parameters
+ * or an IP different then the client's - block it (by not expecting it).
+ * PORT is always sent by the client, which is ftp->src, and the server will always
+ * be ftp->dst.
+ */
+static __u8 ftp_handler(connection *ftp, char *line, unsigned int len){
+    __be32 src_ip   = 0;
+    __be16 src_port = 0;
+    unsigned char tmp[6]; //will be used to parse the ip and port
+    char cmd[DPI_FTP_CMD_MAX]; //null-terminated copy of the command for parsing
+
+    if (strnstr(line, "PORT ", len) == NULL) //no port command in current line
+        return NF_ACCEPT;
+
+    len = min_t(unsigned int, len, sizeof(cmd) - 1);
+    memcpy(cmd, line, len);
+    cmd[len] = '\0';
+    if (sscanf(cmd, "PORT %hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
+               &tmp[0], &tmp[1], &tmp[2], &tmp[3], &tmp[4], &tmp[5]) != 6){
+        printk(KERN_NOTICE "Bad PORT string: %s\n", cmd);
+        return NF_DROP;
+    }
+
+    //some bit magic to get those numbers into the correct vars
+    src_ip = (tmp[3] << 24) | (tmp[2]<<16) | (tmp[1]<<8) | tmp[0]; //net order is big-endian
+    src_port = (tmp[5] << 8) | tmp[4];
+
+#ifdef DEBUG
+    printk(KERN_DEBUG "Parsed ftp PORT: ip %pI4 port %u\n", &src_ip, ntohs(src_port));
+#endif
+    //make sure the client didn't spoof a different ip to gain an exception to the fw
+    if (src_ip != ftp->src_ip){
+        printk(KERN_NOTICE "Non matching ip in port command: client is %pI4 but passed %pI4\n",
+            &ftp->src_ip, &src_ip);
+        return NF_DROP;
+    }
+
+    //a control connection over the expectation limit replaces its oldest one, so
+    //this only fails when we are out of memory - drop the packet, not the connection.
+    //The stream stays before this line, so the command is parsed again when the
+    //packet is retransmitted, and the server never sees it without the expectation
+    if (new_ftp_expect(ftp, src_port, 0))
+        return DPI_RETRY;
+    return NF_ACCEPT;
+}
+
+/* expect a passive mode ftp data connection, based on the server's reply to
+ * PASV ("227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)") or to EPSV
+ * ("229 Entering Extended Passive Mode (|||port|)"). Replies we can't parse,
+ * or that point the client at a host other than the server, are let through
+ * without an expectation - the data connection will then have to match a rule.
+ */
+static __u8 ftp_reply_handler(connection *ftp, char *line, unsigned int len){
+    char reply[DPI_FTP_CMD_MAX]; //null-terminated copy of the reply for parsing
+    unsigned char tmp[6];
+    unsigned int port;
+    __be32 ip;
+    char *p, delim, end;
+
+    if (len < 4 || (strncmp(line, "227 ", 4) && strncmp(line, "229 ", 4)))
+        return NF_ACCEPT;
+    len = min_t(unsigned int, len, sizeof(reply) - 1);
+    memcpy(reply, line, len);
+    reply[len] = '\0';
+
+    if (reply[2] == '7'){ //PASV, the numbers start at the first digit after the code
+        for (p = reply + 4; *p && !isdigit(*p); ++p)
+            ;
+        if (sscanf(p, "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
+                   &tmp[0], &tmp[1], &tmp[2], &tmp[3], &tmp[4], &tmp[5]) != 6)
+            return NF_ACCEPT;
+        ip = (tmp[3] << 24) | (tmp[2]<<16) | (tmp[1]<<8) | tmp[0]; //net order is big-endian
+        if (ip != ftp->dst_ip){
+            printk(KERN_NOTICE "Non matching ip in PASV reply: server is %pI4 but passed %pI4\n",
+                &ftp->dst_ip, &ip);
+            return NF_ACCEPT;
+        }
+        port = (tmp[4] << 8) | tmp[5];
+    } else { //EPSV, the port is between the last two of four identical delimiters
+        p = strchr(reply + 4, '(');
+        if (!p || !p[1] || p[2] != p[1] || p[3] != p[1])
+            return NF_ACCEPT;
+        delim = p[1];
+        if (sscanf(p + 4, "%u%c", &port, &end) != 2 || end != delim)
+            return NF_ACCEPT;
+    }
+    if (!port || port > 0xffff)
+        return NF_ACCEPT;
+#ifdef DEBUG
+    printk(KERN_DEBUG "Parsed ftp passive reply: port %u\n", port);
+#endif
+    if (new_ftp_expect(ftp, htons(port), 1))
+        return DPI_RETRY; //the server will retransmit the reply
+    return NF_ACCEPT;
+}
+
+/* Signature matching */
+/**********************/
+
+/* The signatures the http and smtp handlers look for. All of them are found in
+ * a single pass over a line, by an Aho-Corasick automaton built once on init.
+ */
+typedef enum {
+    SIG_PHP_INDEX,      // PHP File Manager exploit, needs both signatures
+    SIG_PHP_ACTION,
+    SIG_CPG_ANGLE,      // Coppermine Photo Gallery parameters, must have numeric values
+    SIG_CPG_ROTATE,
+    SIG_CPG_CLIPVAL,
+    SIG_C_FIRST,        // common C code patterns, any of them is a leak
+    SIG_C_LAST = SIG_C_FIRST + 8,
+    SIG_COUNT
+} dpi_sig;
+
+#define SIG_BIT(sig) (1U << (sig))
+#define SIG_C_CODE (((SIG_BIT(SIG_C_LAST) << 1) - 1) & ~(SIG_BIT(SIG_C_FIRST) - 1))
+
+static const char *dpi_sigs[SIG_COUNT] = {
+    [SIG_PHP_INDEX]     = "index.php?",
+    [SIG_PHP_ACTION]    = "action=6",
+    [SIG_CPG_ANGLE]     = "angle=",
+    [SIG_CPG_ROTATE]    = "rotate=",
+    [SIG_CPG_CLIPVAL]   = "clipval=",
+    [SIG_C_FIRST]       = "#include ", "#define ", "#ifdef ", "int main(", "void main(",
+                          "return 0;", "printf(\"", "malloc(", "return;"
+};
+static unsigned char dpi_sig_lens[SIG_COUNT];
+
+/* A state of the automaton. The fail transitions are resolved when it is
+ * built, so every char leads directly to the next state.
+ */
+struct dpi_ac_state {
+    u32 out; // the signatures that end in this state
+    __u8 next[256]; // the next state for every char
+};
+static struct dpi_ac_state *dpi_ac; // the automaton, state 0 is the start state
+
+/* find the signatures in a line of len chars in one pass, and set pos[sig] to
+ * the first occurrence of every signature found. Stops as soon as one of the
+ * signatures in stop is found. returns the found signatures as a bit mask.
+ */
+static u32 scan_line(const char *line, unsigned int len, const char **pos, u32 stop){
+    const char *end = line + len;
+    unsigned int state = 0;
+    u32 found = 0, new;
+    int sig;
+    for (; line < end; ++line){
+        state = dpi_ac[state].next[(unsigned char)*line];
+        new = dpi_ac[state].out & ~found;
+        if (likely(!new))
+            continue;
+        found |= new;
+        do {
+            sig = __ffs(new);
+            pos[sig] = line + 1 - dpi_sig_lens[sig];
+            new &= new - 1;
+        } while (new);
+        if (found & stop)
+            break;
+    }
+    return found;
+}
+
+/* build the automaton for the signatures - a trie of the signatures, with the
+ * missing transitions of every state filled by following its fail state.
+ * returns 0 on success, negative error otherwise.
+ */
+static int build_dpi_ac(void){
+    unsigned int count = 1, head = 0, tail = 0, total = 1;
+    unsigned int state, child, c, sig;
+    const unsigned char *p;
+    __u8 *fail, *queue;
+    for (sig = 0; sig < SIG_COUNT; ++sig){
+        dpi_sig_lens[sig] = strlen(dpi_sigs[sig]);
+        total += dpi_sig_lens[sig];
+    }
+    if (total > 256) //states must fit in a transition
+        return -EINVAL;
+    dpi_ac = vzalloc(sizeof(struct dpi_ac_state) * total);
+    fail = kzalloc(total, GFP_KERNEL);
+    queue = kmalloc(total, GFP_KERNEL);
+    if (!dpi_ac || !fail || !queue){
+        vfree(dpi_ac);
+        kfree(fail);
+        kfree(queue);
+        return -ENOMEM;
+    }
+    //build the trie, 0 marks a missing transition as no state leads back to the start
+    for (sig = 0; sig < SIG_COUNT; ++sig){
+        state = 0;
+        for (p = (const unsigned char *)dpi_sigs[sig]; *p; ++p){
+            if (!dpi_ac[state].next[*p])
+                dpi_ac[state].next[*p] = count++;
+            state = dpi_ac[state].next[*p];
+        }
+        dpi_ac[state].out |= SIG_BIT(sig);
+    }
+    //go over the states by depth, so the fail state of each state is complete before we need it
+    queue[tail++] = 0;
+    while (head < tail){
+        state = queue[head++];
+        for (c = 0; c < 256; ++c){
+            child = dpi_ac[state].next[c];
+            if (child){ //a trie edge, its fail state is where the fail state of its parent leads
+                fail[child] = state ? dpi_ac[fail[state]].next[c] : 0;
+                dpi_ac[child].out |= dpi_ac[fail[child]].out;
+                queue[tail++] = child;
+            } else { //a missing edge, continue from the fail state
+                dpi_ac[state].next[c] = state ? dpi_ac[fail[state]].next[c] : 0;
+            }
+        }
+    }
+    kfree(fail);
+    kfree(queue);
+    return 0;
+}
+
+/* check if the value of a Coppermine Photo Gallery parameter is not numeric */
+static int bad_cpg_value(const char *value, const char *end, int allow_comma){
+    for (; value < end && *value != '\0' && *value != '\r' && *value != '&'; ++value){
+        if (!isdigit(*value) && !(allow_comma && *value == ',')) //clipval can also contain ,
+            return 1;
+    }
+    return 0;
+}
+
+/* check if any of the vulnerable CPG parameters that were found in a line has an illegal value */
+static int check_cpg(u32 found, const char **pos, const char *end){
+    return (((found & SIG_BIT(SIG_CPG_ANGLE)) &&
+             bad_cpg_value(pos[SIG_CPG_ANGLE] + dpi_sig_lens[SIG_CPG_ANGLE], end, 0)) ||
+            ((found & SIG_BIT(SIG_CPG_ROTATE)) &&
+             bad_cpg_value(pos[SIG_CPG_ROTATE] + dpi_sig_lens[SIG_CPG_ROTATE], end, 0)) ||
+            ((found & SIG_BIT(SIG_CPG_CLIPVAL)) &&
+             bad_cpg_value(pos[SIG_CPG_CLIPVAL] + dpi_sig_lens[SIG_CPG_CLIPVAL], end, 1)));
+}
+
+/* Protocol parsers */
+/********************/
+
+/* The http and smtp handlers track where they are in the protocol in
+ * con->dpi_state, so each check only runs on the lines it is meant for.
+ */
+typedef enum {
+    HTTP_REQUEST,           // waiting for a request line, blank lines between requests are skipped
+    HTTP_HEADERS,
+    HTTP_HEADERS_CHUNKED,   // headers of a request with a chunked body
+    HTTP_BODY,              // a body of Content-Length bytes, in con->dpi_left
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_DATA,
+    HTTP_TRAILERS           // headers after the last chunk
+} http_state;
+
+typedef enum {
+    SMTP_COMMAND,
+    SMTP_DATA,              // a message, until a line with a single '.'
+    SMTP_BDAT               // a BDAT chunk, its size is in con->dpi_left
+} smtp_state;
+
+/* check if a line starts with the given header or command name, ignoring case */
+static int line_starts_with(const char *line, unsigned int len, const char *name){
+    size_t name_len = strlen(name);
+    return len >= name_len && !strncasecmp(line, name, name_len);
+}
+
+/* parse the length at the start of a value, in base 10 or 16, skipping leading
+ * whitespace. The number may only be followed by whitespace or a ';' (chunk
+ * extensions).
+ * returns 0 on success, -1 if there is no valid length.
+ */
+static int parse_length(const char *value, const char *end, unsigned int base, u32 *length){
+    u64 n = 0;
+    const char *start;
+    int digit;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        ++value;
+    for (start = value; value < end; ++value){
+        digit = hex_to_bin(*value);
+        if (digit < 0 || digit >= base)
+            break;
+        n = n * base + digit;
+        if (n > 0xffffffff) //too long to track, we can't tell where it ends
+            return -1;
+    }
+    if (value == start || (value < end && *value != ' ' && *value != '\t' && *value != ';'))
+        return -1;
+    *length = n;
+    return 0;
+}
+
+/* check the parameters of an http request line or body for known exploits:
+ * PHP File Manager vulnerability
+ * Coppermine Photo Gallery vulnerability
+ * and a body for C code leaks.
+ */
+static __u8 check_http_params(char *line, unsigned int len, int body){
+    const char *pos[SIG_COUNT];
+    u32 found = scan_line(line, len, pos, body ? SIG_C_CODE : 0);
+
+    //check for php file manager vulnerability
+    if ((found & SIG_BIT(SIG_PHP_INDEX)) && (found & SIG_BIT(SIG_PHP_ACTION))){
+        printk(KERN_NOTICE "Blocked PHP File Manager exploit attempt: %.*s\n", len, line);
+        return NF_DROP;
+    }
+
+    //check for Coppermine Photo Gallery vulnerability
+    if (check_cpg(found, pos, line + len)){
+        printk(KERN_NOTICE "Blocked Coppermine Photo Gallery exploit attempt: %.*s\n", len, line);
+        return NF_DROP;
+    }
+
+    //scan for C code
+    if (body && (found & SIG_C_CODE)){
+        printk(KERN_NOTICE "Blocked possible C code leak: %.*s\n", len, line);
+        return NF_DROP;
+    }
+    return NF_ACCEPT;
+}
+
+/* check an http request header - the host against the blocked hosts, and
+ * the headers that tell where the body ends.
+ */
+static __u8 check_http_header(connection *con, char *line, unsigned int len){
+    const char *value, *end = line + len;
+
+    //check for blocked hosts, the host is looked up in the packet
+    if (line_starts_with(line, len, "Host:")){
+        for (value = line + 5; value < end && (*value == ' ' || *value == '\t'); ++value);
+        if (check_hosts(value, end - value)){
+            printk(KERN_NOTICE "Blocked Host: %.*s\n", (int)(end - value), value);
+            return NF_DROP;
+        }
+    } else if (line_starts_with(line, len, "Content-Length:")){
+        if (parse_length(line + 15, end, 10, &con->dpi_length)){
+            printk(KERN_NOTICE "Blocked bad http Content-Length: %.*s\n", len, line);
+            return NF_DROP;
+        }
+    } else if (line_starts_with(line, len, "Transfer-Encoding:")){
+        if (strnstr(line + 18, "chunked", len - 18)) //chunked wins over Content-Length
+            con->dpi_state = HTTP_HEADERS_CHUNKED;
+    }
+    return NF_ACCEPT;
+}
+
+/* check if a line starts like an http request line - with a method, an upper
+ * case token followed by a space.
+ */
+static int is_request_line(const char *line, unsigned int len){
+    unsigned int i;
+    for (i = 0; i < len && isupper(line[i]); ++i)
+        ;
+    return i && i < len && line[i] == ' ';
+}
+
+/* Check http requests. The request line and body are checked for known
+ * exploits, the body for C code leaks and the headers for blocked hosts.
+ * Bodies are tracked by Content-Length or chunked encoding, so pipelined
+ * requests are parsed as well. A request with neither has no body, so data
+ * after it that isn't another request is blocked rather than left unchecked.
+ */
+static __u8 http_handler(connection * con, char *line, unsigned int len){
+    __u8 res;
+    switch (con->dpi_state){
+    case HTTP_REQUEST:
+        if (!len)
+            return NF_ACCEPT;
+        if (!is_request_line(line, len)){
+            printk(KERN_NOTICE "Blocked bad http request line: %.*s\n", len, line);
+            return NF_DROP;
+        }
+        con->dpi_state = HTTP_HEADERS;
+        con->dpi_length = 0;
+        return check_http_params(line, len, 0);
+    case HTTP_HEADERS:
+    case HTTP_HEADERS_CHUNKED:
+        if (len)
+            return check_http_header(con, line, len);
+        //a blank line ends the headers
+        if (con->dpi_state == HTTP_HEADERS_CHUNKED){
+            con->dpi_state = HTTP_CHUNK_SIZE;
+        } else if (con->dpi_length){
+            con->dpi_state = HTTP_BODY;
+            con->dpi_left = con->dpi_length;
+        } else { //no body, the next line must be a request
+            con->dpi_state = HTTP_REQUEST;
+        }
+        return NF_ACCEPT;
+    case HTTP_BODY:
+    case HTTP_CHUNK_DATA:
+        res = check_http_params(line, len, 1);
+        if (!con->dpi_left) //this line ended the body or chunk
+            con->dpi_state = con->dpi_state == HTTP_BODY ? HTTP_REQUEST : HTTP_CHUNK_SIZE;
+        return res;
+    case HTTP_CHUNK_SIZE:
+        if (!len) //the line end after the chunk data
+            return NF_ACCEPT;
+        if (parse_length(line, line + len, 16, &con->dpi_left)){
+            printk(KERN_NOTICE "Blocked bad http chunk size: %.*s\n", len, line);
+            return NF_DROP;
+        }
+        con->dpi_state = con->dpi_left ? HTTP_CHUNK_DATA : HTTP_TRAILERS;
+        return NF_ACCEPT;
+    case HTTP_TRAILERS:
+        if (!len)
+            con->dpi_state = HTTP_REQUEST;
+        return NF_ACCEPT;
+    }
+    return NF_ACCEPT;
+}
+
+/* check a part of a long http line - the request line and body for known
+ * exploits. Headers are only checked by their head, once the line ends.
+ */
+static __u8 http_partial_handler(connection *con, char *line, unsigned int len){
+    switch (con->dpi_state){
+    case HTTP_REQUEST:
+        return check_http_params(line, len, 0);
+    case HTTP_BODY:
+    case HTTP_CHUNK_DATA:
+        return check_http_params(line, len, 1);
+    }
+    return NF_ACCEPT;
+}
+
+/* check a line of a mail message for C code */
+static __u8 check_c_code(char *line, unsigned int len){
+    const char *pos[SIG_COUNT];
+    if (scan_line(line, len, pos, SIG_C_CODE) & SIG_C_CODE){
+        printk(KERN_NOTICE "Blocked possible C code leak: %.*s\n", len, line);
+        return NF_DROP;
+    }
+    return NF_ACCEPT;
+}
+
+/* prevent SMTP messages from leaking C code. Only the message data is checked,
+ * sent after a DATA command or in BDAT chunks.
+ */
+static __u8 smtp_handler(connection * con, char *line, unsigned int len){
+    switch (con->dpi_state){
+    case SMTP_COMMAND:
+        if (line_starts_with(line, len, "DATA") && (len == 4 || line[4] == ' ')){
+            con->dpi_state = SMTP_DATA;
+        } else if (line_starts_with(line, len, "BDAT ")){
+            if (parse_length(line + 5, line + len, 10, &con->dpi_left)){
+                printk(KERN_NOTICE "Blocked bad smtp BDAT size: %.*s\n", len, line);
+                return NF_DROP;
+            }
+            if (con->dpi_left)
+                con->dpi_state = SMTP_BDAT;
+        }
+        return NF_ACCEPT;
+    case SMTP_DATA:
+        if (len == 1 && line[0] == '.'){ //end of the message
+            con->dpi_state = SMTP_COMMAND;
+            return NF_ACCEPT;
+        }
+        break;
+    case SMTP_BDAT:
+        if (!con->dpi_left)
+            con->dpi_state = SMTP_COMMAND;
+        break;
+    }
+    return check_c_code(line, len);
+}
+
+/* check a part of a long smtp line - message data for C code */
+static __u8 smtp_partial_handler(connection *con, char *line, unsigned int len){
+    return con->dpi_state == SMTP_COMMAND ? NF_ACCEPT : check_c_code(line, len);
+}
+
+/* Inspector registry */
+/**********************/
+
+// the inspectors by id, their stats are allocated on init
+static struct dpi_inspector dpi_inspectors[DPI_INSPECTORS] = {
+    [DPI_NONE] = { "none", NULL, NULL, NULL, 0, 0, NULL },
+    [DPI_HTTP] = { "http", http_handler, http_partial_handler, NULL, 0, 0, NULL },
+    [DPI_FTP]  = { "ftp", ftp_handler, NULL, ftp_reply_handler, 0, 0, NULL },
+    [DPI_SMTP] = { "smtp", smtp_handler, smtp_partial_handler, NULL, 0, 0, NULL }
+};
+
+// the inspector id of each destination port, indexed in host order
+static __u8 dpi_ports[1 << 16] = {
+    [80] = DPI_HTTP, //scan http connections for blocked hosts & vulnerabilities
+    [21] = DPI_FTP,  //scan ftp connections for PORT commands and passive replies
+    [25] = DPI_SMTP  //scan smtp connections for C code leaks
+};
+
+/* get the id of the inspector of data sent to a port, DPI_NONE if it isn't inspected */
+dpi_id dpi_port_id(__be16 dst_port){
+    return ACCESS_ONCE(dpi_ports[ntohs(dst_port)]);
+}
+
+/* get the inspector with the given id, or NULL for DPI_NONE */
+struct dpi_inspector * dpi_get_inspector(dpi_id id){
+    return id == DPI_NONE ? NULL : &dpi_inspectors[id];
+}
+
+/* get the id of the inspector with the given name, or DPI_INSPECTORS if there is none */
+static dpi_id dpi_find_inspector(const char *name){
+    dpi_id id;
+    for (id = DPI_NONE; id < DPI_INSPECTORS; ++id){
+        if (!strcmp(dpi_inspectors[id].name, name))
+            return id;
+    }
+    return DPI_INSPECTORS;
+}
+
+/* Stream reassembly */
+/*********************/
+
+/* free the out of order segments held for a connection */
+static void release_dpi_segs(connection *con){
+    struct dpi_seg *seg;
+    while ((seg = con->dpi_segs)){
+        con->dpi_segs = seg->next;
+        kfree(seg);
+    }
+    con->dpi_segs_len = 0;
+}
+
+/* release all of the connection's inspection state */
+void release_dpi(connection *con){
+    release_dpi_buf(con);
+    release_dpi_segs(con);
+}
+
+/* hold a copy of an out of order segment, len bytes of the skb from offset,
+ * until the data before it arrives.
+ * returns NF_ACCEPT if the segment is held (or already was), DPI_RETRY if it can't be.
+ */
+static __u8 hold_dpi_seg(connection *con, u32 seq, struct sk_buff *skb, unsigned int offset, unsigned int len){
+    struct dpi_seg **pos = &con->dpi_segs, *seg;
+    while (*pos && before((*pos)->seq, seq)) //keep the segments sorted by sequence number
+        pos = &(*pos)->next;
+    if (*pos && (*pos)->seq == seq && (*pos)->len >= len) //a retransmission of a held segment
+        return NF_ACCEPT;
+    if (con->dpi_segs_len + len > DPI_SEGS_MAX_BYTES)
+        return DPI_RETRY;
+    seg = kmalloc(sizeof(struct dpi_seg) + len, GFP_ATOMIC | __GFP_NOWARN);
+    if (!seg)
+        return DPI_RETRY;
+    if (skb_copy_bits(skb, offset, seg->data, len)){
+        kfree(seg);
+        return DPI_RETRY;
+    }
+    seg->seq = seq;
+    seg->len = len;
+    seg->next = *pos;
+    *pos = seg;
+    con->dpi_segs_len += len;
+#ifdef DEBUG
+    printk(KERN_DEBUG "holding out of order segment, seq %u expected %u length %u\n", seq, con->dpi_seq, len);
+#endif
+    return NF_ACCEPT;
+}
+
+/* Line scanning */
+/*****************/
+
+#define ONES_WORD (~0UL / 0xff) // 0x0101...01
+#define HIGHS_WORD (ONES_WORD * 0x80) // 0x8080...80
+
+/* check if a char ends a line */
+static int is_line_end(unsigned char c){
+    return c == '\r' || c == '\n' || c == '\0';
+}
+
+/* check if any byte of a word is zero */
+static unsigned long word_has_zero(unsigned long word){
+    return (word - ONES_WORD) & ~word & HIGHS_WORD;
+}
+
+/* check if any byte of a word ends a line */
+static unsigned long word_has_line_end(unsigned long word){
+    return word_has_zero(word) | word_has_zero(word ^ (ONES_WORD * '\r')) |
+           word_has_zero(word ^ (ONES_WORD * '\n'));
+}
+
+/* find the first line end in data, a word at a time.
+ * returns its offset, or len if there is none.
+ */
+static unsigned int find_line_end(const unsigned char *data, unsigned int len){
+    unsigned int pos = 0;
+    //go byte by byte until the data is aligned, then word by word until a word has a line end
+    for (; pos < len && ((unsigned long)(data + pos) & (sizeof(unsigned long) - 1)); ++pos){
+        if (is_line_end(data[pos]))
+            return pos;
+    }
+    while (pos + sizeof(unsigned long) <= len && !word_has_line_end(*(const unsigned long *)(data + pos)))
+        pos += sizeof(unsigned long);
+    while (pos < len && !is_line_end(data[pos]))
+        ++pos;
+    return pos;
+}
+
+/* check a line with the inspector's handler and count it */
+static __u8 check_line(connection *con, struct dpi_inspector *insp, char *line, unsigned int len){
+    struct dpi_stats *stats = this_cpu_ptr(insp->stats); //we run with bh disabled, under dpi_lock
+    __u8 res = insp->handler(con, line, len);
+    ++stats->lines;
+    if (res == NF_DROP)
+        ++stats->drops;
+    return res;
+}
+
+/* check a part of a cut line with the inspector's partial handler. It doesn't
+ * count as a line, as the handler still gets the line when it ends.
+ */
+static __u8 check_partial(connection *con, struct dpi_inspector *insp, char *part, unsigned int len){
+    __u8 res;
+    if (!insp->partial_handler)
+        return NF_ACCEPT;
+    res = insp->partial_handler(con, part, len);
+    if (res == NF_DROP)
+        ++this_cpu_ptr(insp->stats)->drops;
+    return res;
+}
+
+/* check the line in the connection's buffer. If the line was cut, the chars
+ * after its last part are checked by the partial handler, and the handler
+ * gets the head of the line.
+ */
+static __u8 check_buffered_line(connection *con, struct dpi_inspector *insp){
+    struct dpi_buf *buf = con->dpi;
+    __u8 res;
+    if (!buf->cut)
+        return check_line(con, insp, buf->data, buf->len);
+    res = check_partial(con, insp, buf->data + DPI_LINE_HEAD, buf->len - DPI_LINE_HEAD);
+    if (res != NF_ACCEPT)
+        return res;
+    return check_line(con, insp, buf->data, DPI_LINE_HEAD);
+}
+
+/* append part of a line that spans packets to the connection's buffer. If the
+ * line doesn't fit in the largest buffer, it is cut - the part after its head
+ * is checked by the partial handler, and only its last DPI_LINE_OVERLAP chars
+ * are kept after the head, so we don't miss anything.
+ * returns DPI_RETRY if the buffer can't grow because we are out of memory, in
+ * which case the buffer is left as it was.
+ */
+static __u8 buffer_line(connection *con, const unsigned char *chars, unsigned int len, struct dpi_inspector *insp){
+    struct dpi_buf *buf = con->dpi, *new_buf;
+    unsigned int room, count, used, start = buf ? buf->len : 0, part;
+    BUILD_BUG_ON(DPI_LINE_HEAD + DPI_LINE_OVERLAP >= DPI_BUF_CHARS(DPI_BUF_CLASSES - 1)); //they must fit in the largest buffer
+    while (len){
+        used = buf ? buf->len : 0;
+        room = buf ? dpi_buf_size(buf->size_class) - used : 0;
+        if (room){
+            count = min(room, len);
+            memcpy(buf->data + buf->len, chars, count);
+            buf->len += count;
+            chars += count;
+            len -= count;
+            continue;
+        }
+        new_buf = grow_dpi_buf(buf, used); //frees the old buffer if it grew
+        if (new_buf){
+            new_buf->len = used;
+            buf = con->dpi = new_buf;
+        } else if (!buf || buf->size_class < DPI_BUF_CLASSES - 1){ //can't allocate a buffer
+            printk(KERN_ERR "Error allocating memory for inspection buffer.\n");
+            if (start) //drop what we added, the chars are read again from the retransmission
+                buf->len = start;
+            else
+                release_dpi_buf(con);
+            return DPI_RETRY;
+        } else { //the largest buffer is full, check the part after the head
+            part = buf->cut ? DPI_LINE_HEAD : 0; //the first part includes the head
+            if (check_partial(con, insp, buf->data + part, buf->len - part) == NF_DROP)
+                return NF_DROP;
+            //copy the last chars to right after the head and continue
+            memmove(buf->data + DPI_LINE_HEAD, buf->data + buf->len - DPI_LINE_OVERLAP, DPI_LINE_OVERLAP);
+            buf->len = DPI_LINE_HEAD + DPI_LINE_OVERLAP;
+            buf->cut = 1;
+        }
+    }
+    return NF_ACCEPT;
+}
+
+/* Values of con->dpi_cr - whether the '\n' that may follow a '\r' line end is
+ * inside a length-delimited part, and counts against it.
+ */
+#define DPI_CR 1
+#define DPI_CR_IN_PART 2
+
+/* read data line by line and check it is valid according to the inspector.
+ * Whole lines are checked in place, only a line that spans several packets is
+ * copied to a buffer, which is attached to the connection until the line ends.
+ * Reading stops once the connection uses up the inspector's budget.
+ * read is set to the number of bytes that were read. Only on DPI_RETRY is it
+ * less than data_len - the stream is left at the start of the line that
+ * couldn't be read, so it is read again when the packet is retransmitted.
+ */
+static __u8 parse_data(connection * con, unsigned char *data, unsigned int data_len,
+                       struct dpi_inspector *insp, unsigned int *read){
+    unsigned int pos = 0, end, next, limit, line = 0, used, budget = ACCESS_ONCE(insp->budget);
+    int headers_only = ACCESS_ONCE(insp->headers_only), in_part, cut, blank, last = 0;
+    u32 left = 0;
+    __u8 res = NF_ACCEPT, cr, line_cr = 0;
+    *read = data_len;
+    if (budget && con->dpi_read + data_len >= budget){ //only read what is left of the budget
+        data_len = budget > con->dpi_read ? budget - con->dpi_read : 0;
+        last = 1;
+    }
+    while (pos < data_len && res == NF_ACCEPT){
+        //the state at the start of the line, to go back to if it can't be read now
+        line = pos;
+        left = con->dpi_left;
+        line_cr = con->dpi_cr;
+        if (con->dpi_cr){ //a '\n' right after a '\r' ends the same line
+            in_part = con->dpi_cr == DPI_CR_IN_PART;
+            con->dpi_cr = 0;
+            if (data[pos] == '\n'){
+                ++pos;
+                if (in_part && !--con->dpi_left) //it was the last byte of the part
+                    res = check_line(con, insp, (char *)data + pos, 0);
+                continue;
+            }
+        }
+        in_part = con->dpi_left != 0;
+        cut = in_part && con->dpi_left <= data_len - pos; //the part ends in this data
+        limit = cut ? pos + con->dpi_left : data_len;
+        end = pos + find_line_end(data + pos, limit - pos);
+        if (end == limit && !cut){ //the line continues in the next packet, keep what we have
+            res = buffer_line(con, data + pos, end - pos, insp);
+            if (res == NF_ACCEPT && in_part)
+                con->dpi_left -= end - pos;
+            break;
+        }
+        next = end < limit ? end + 1 : limit;
+        used = con->dpi ? con->dpi->len : 0;
+        if (con->dpi){ //the line started in an earlier packet, complete it in the buffer
+            res = buffer_line(con, data + pos, end - pos, insp);
+            if (res != NF_ACCEPT)
+                break;
+        }
+        if (in_part)
+            con->dpi_left -= next - pos;
+        cr = end < limit && data[end] == '\r' ? (con->dpi_left ? DPI_CR_IN_PART : DPI_CR) : 0;
+        blank = !in_part && end == pos && !con->dpi;
+        if (con->dpi){
+            res = check_buffered_line(con, insp);
+            if (res == DPI_RETRY){ //keep the start of the line for the retransmission
+                if (con->dpi->len == used + end - pos)
+                    con->dpi->len = used;
+                else //the start of the line was already checked and cut off, it can't be read again
+                    res = NF_DROP;
+            }
+        } else if (end > pos || !in_part || !con->dpi_left){ //blank lines in a part are skipped, unless they end it
+            res = check_line(con, insp, (char *)data + pos, end - pos);
+        }
+        if (res == DPI_RETRY)
+            break;
+        release_dpi_buf(con);
+        con->dpi_cr = cr;
+        pos = next;
+        if (blank && headers_only){ //the rest is the body, which isn't inspected
+            con->dpi_done = 1;
+            break;
+        }
+    }
+    if (res == DPI_RETRY){ //go back to the start of the line, the rest isn't read yet
+        con->dpi_left = left;
+        con->dpi_cr = line_cr;
+        *read = data_len = line;
+        last = 0;
+    }
+    con->dpi_read += data_len;
+    this_cpu_ptr(insp->stats)->bytes += data_len;
+    if (last)
+        con->dpi_done = 1;
+    if (res == NF_DROP) //no need to keep the line
+        release_dpi_buf(con);
+    return res;
+}
+
+/* read len bytes of an skb from offset, a fragment at a time, without linearizing it.
+ * read is set to the number of bytes that were read, as by parse_data.
+ */
+static __u8 parse_skb_data(connection *con, struct sk_buff *skb, unsigned int offset,
+                           unsigned int len, struct dpi_inspector *insp, unsigned int *read){
+    struct skb_seq_state state;
+    unsigned int consumed = 0, frag_len, frag_read;
+    const u8 *data;
+    __u8 res = NF_ACCEPT;
+    skb_prepare_seq_read(skb, offset, offset + len, &state);
+    while ((frag_len = skb_seq_read(consumed, &data, &state))){
+        res = parse_data(con, (unsigned char *)data, frag_len, insp, &frag_read);
+        consumed += frag_read;
+        if (res != NF_ACCEPT || con->dpi_done){
+            skb_abort_seq_read(&state); //unmap the current fragment
+            break;
+        }
+    }
+    *read = consumed;
+    return res;
+}
+
+/* read a packet's data in stream order and check it is valid according to the inspector.
+ * Data that was already read is skipped, and data that arrived early is held
+ * and read once the data before it arrives.
+ * The stream only advances past the bytes that were read, so on DPI_RETRY the
+ * rest of the packet, or of a held segment it connected, is read again when the
+ * packet is retransmitted.
+ * The data is read straight from the skb's fragments, so GRO/GSO packets are
+ * inspected whole without being linearized.
+ */
+__u8 parse_packet(connection * con, struct tcphdr *tcp_header, struct sk_buff *skb,
+                  unsigned int data_off, struct dpi_inspector *insp){
+    unsigned int data_len, read; //tcp data length
+    u32 seq = ntohl(tcp_header->seq), skip;
+    u64 start = local_clock();
+    struct dpi_seg *seg;
+    __u8 res;
+    if (data_off >= skb->len || con->dpi_done) //no data, or the budget was used up by an earlier packet
+        return NF_ACCEPT;
+    data_len = skb->len - data_off;
+#ifdef DEBUG
+    printk(KERN_DEBUG "parsing tcp packet, seq %u length %u:\n", seq, data_len);
+#endif
+    if (before(seq, con->dpi_seq)){ //a retransmission, only read what we didn't read yet
+        skip = min(con->dpi_seq - seq, data_len);
+        data_off += skip;
+        data_len -= skip;
+        seq += skip;
+    }
+    if (after(seq, con->dpi_seq)) //some data before this segment is missing
+        return hold_dpi_seg(con, seq, skb, data_off, data_len);
+
+    res = NF_ACCEPT;
+    if (data_len){
+        res = parse_skb_data(con, skb, data_off, data_len, insp, &read);
+        con->dpi_seq += read;
+    }
+    //read the held segments the stream reached, a retransmission reads the ones a retry left
+    while (res == NF_ACCEPT && !con->dpi_done && (seg = con->dpi_segs) && !after(seg->seq, con->dpi_seq)){
+        if (after(seg->seq + seg->len, con->dpi_seq)){ //skip the part we already read
+            skip = con->dpi_seq - seg->seq;
+            res = parse_data(con, seg->data + skip, seg->len - skip, insp, &read);
+            con->dpi_seq += read;
+            if (res == DPI_RETRY) //keep the segment until the rest of it is read
+                break;
+        }
+        con->dpi_segs = seg->next;
+        con->dpi_segs_len -= seg->len;
+        kfree(seg);
+    }
+    if (con->dpi_done && res != NF_DROP){ //the budget is used up, the rest of the connection isn't inspected
+        if (res == NF_ACCEPT && con->dpi && con->dpi->len) //check the part of the last line that is within the budget
+            res = check_buffered_line(con, insp);
+#ifdef DEBUG
+        printk(KERN_DEBUG "inspection budget used up after %u bytes\n", con->dpi_read);
+#endif
+        ++this_cpu_ptr(insp->stats)->exhausted;
+        release_dpi(con);
+    }
+    this_cpu_ptr(insp->stats)->time += local_clock() - start;
+    return res;
+}
+
+/* check the lines of a packet the server sent with the inspector's reply handler.
+ * Replies are checked packet by packet rather than as a stream, and only their
+ * first DPI_REPLY_MAX bytes, which is enough for the short replies they look for.
+ */
+__u8 parse_reply(connection *con, struct sk_buff *skb, unsigned int data_off, struct dpi_inspector *insp){
+    struct dpi_stats *stats = this_cpu_ptr(insp->stats); //we run with bh disabled, under dpi_lock
+    unsigned char buf[DPI_REPLY_MAX], *data;
+    unsigned int data_len, pos = 0, end;
+    u64 start = local_clock();
+    __u8 res = NF_ACCEPT;
+    if (data_off >= skb->len)
+        return NF_ACCEPT;
+    data_len = min_t(unsigned int, skb->len - data_off, sizeof(buf));
+    data = skb_header_pointer(skb, data_off, data_len, buf);
+    if (!data)
+        return NF_ACCEPT;
+    stats->bytes += data_len;
+    while (pos < data_len && res == NF_ACCEPT){
+        end = pos + find_line_end(data + pos, data_len - pos);
+        if (end > pos){
+            res = insp->reply_handler(con, (char *)data + pos, end - pos);
+            ++stats->lines;
+            if (res != NF_ACCEPT)
+                ++stats->drops;
+        }
+        pos = end + 1;
+    }
+    stats->time += local_clock() - start;
+    return res;
+}
+
+/* dpi sysfs functions and attributes */
+/**************************************/
+
+static int major_number;
+static struct device *dev = NULL;
+static struct file_operations fops = {
+    .owner = THIS_MODULE
+};
+
+/* sysfs attribute to show the inspected ports, one "<port> <inspector>" line per port */
+static ssize_t show_ports(struct device *dev, struct device_attribute *attr, char *buf){
+    ssize_t len = 0;
+    unsigned int port;
+    __u8 id;
+    for (port = 0; port < ARRAY_SIZE(dpi_ports); ++port){
+        id = ACCESS_ONCE(dpi_ports[port]);
+        if (id != DPI_NONE)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%u %s\n", port, dpi_inspectors[id].name);
+    }
+    return len;
+}
+
+/* sysfs attribute to map ports to inspectors.
+ * Takes "<port> <inspector>" lines, where the inspector is one of the
+ * inspector names or "none" to stop inspecting the port. Only new
+ * connections are affected, open ones keep the inspector they started with.
+ */
+static ssize_t set_ports(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    char name[16];
+    unsigned int port;
+    int read;
+    dpi_id id;
+    const char *pos = buf, *end = buf + count;
+    while (pos < end && sscanf(pos, "%u %15s%n", &port, name, &read) == 2){
+        id = dpi_find_inspector(name);
+        if (port >= ARRAY_SIZE(dpi_ports) || id == DPI_INSPECTORS)
+            return -EINVAL;
+#ifdef DEBUG
+        printk(KERN_DEBUG "inspecting port %u with %s\n", port, name);
+#endif
+        ACCESS_ONCE(dpi_ports[port]) = id;
+        pos += read;
+    }
+    return count;
+}
+
+/* sysfs attribute to show each inspector's budget, "<inspector> <bytes> <all|headers>" */
+static ssize_t show_budget(struct device *dev, struct device_attribute *attr, char *buf){
+    ssize_t len = 0;
+    dpi_id id;
+    for (id = DPI_NONE + 1; id < DPI_INSPECTORS; ++id)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %u %s\n", dpi_inspectors[id].name,
+                         ACCESS_ONCE(dpi_inspectors[id].budget),
+                         ACCESS_ONCE(dpi_inspectors[id].headers_only) ? "headers" : "all");
+    return len;
+}
+
+/* sysfs attribute to set inspector budgets.
+ * Takes "<inspector> <bytes> <all|headers>" lines, where bytes is the number of
+ * bytes to inspect per connection or 0 for no limit, and "headers" stops
+ * inspecting after the first empty line. Connections that are already open
+ * use the new budget from their next packet.
+ */
+static ssize_t set_budget(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    char name[16], scope[8];
+    unsigned int budget;
+    int read;
+    dpi_id id;
+    const char *pos = buf, *end = buf + count;
+    while (pos < end && sscanf(pos, "%15s %u %7s%n", name, &budget, scope, &read) == 3){
+        id = dpi_find_inspector(name);
+        if (id == DPI_NONE || id == DPI_INSPECTORS || (strcmp(scope, "all") && strcmp(scope, "headers")))
+            return -EINVAL;
+#ifdef DEBUG
+        printk(KERN_DEBUG "inspection budget of %s set to %u bytes, %s\n", name, budget, scope);
+#endif
+        ACCESS_ONCE(dpi_inspectors[id].budget) = budget;
+        ACCESS_ONCE(dpi_inspectors[id].headers_only) = !strcmp(scope, "headers");
+        pos += read;
+    }
+    return count;
+}
+
+/* sysfs attribute to show each inspector's counters, summed over all cpus:
+ * "<inspector> <bytes> <lines> <time in ns> <drops> <budgets used up>"
+ */
+static ssize_t show_dpi_stats(struct device *dev, struct device_attribute *attr, char *buf){
+    ssize_t len = 0;
+    struct dpi_stats total, *stats;
+    dpi_id id;
+    int cpu;
+    for (id = DPI_NONE + 1; id < DPI_INSPECTORS; ++id){
+        memset(&total, 0, sizeof(total));
+        for_each_possible_cpu(cpu){
+            stats = per_cpu_ptr(dpi_inspectors[id].stats, cpu);
+            total.bytes += stats->bytes;
+            total.lines += stats->lines;
+            total.time  += stats->time;
+            total.drops += stats->drops;
+            total.exhausted += stats->exhausted;
+        }
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu %llu %llu %llu %llu\n", dpi_inspectors[id].name,
+                         (unsigned long long)total.bytes, (unsigned long long)total.lines,
+                         (unsigned long long)total.time, (unsigned long long)total.drops,
+                         (unsigned long long)total.exhausted);
+    }
+    return len;
+}
+
+/* sysfs attributes */
+static struct device_attribute dpi_attrs[]= {
+        __ATTR(ports, S_IRUSR | S_IWUSR, show_ports, set_ports),
+        __ATTR(budget, S_IRUSR | S_IWUSR, show_budget, set_budget),
+        __ATTR(stats, S_IRUSR, show_dpi_stats, NULL),
+        __ATTR_NULL // stopping condition for loop in device_add_attributes()
+    };
+
+/* free the inspectors' counters */
+static void free_dpi_stats(void){
+    dpi_id id;
+    for (id = DPI_NONE + 1; id < DPI_INSPECTORS; ++id){
+        free_percpu(dpi_inspectors[id].stats);
+        dpi_inspectors[id].stats = NULL;
+    }
+}
+
+/* initialize the dpi module */
+int init_dpi(void){
+    int i, err;
+    dpi_id id;
+#ifdef DEBUG
+    printk(KERN_DEBUG "initializing dpi buffer pool\n");
+#endif
+    if ((err = build_dpi_ac())){
+        printk(KERN_ERR "Error building the signatures automaton.\n");
+        return err;
+    }
+    for (i = 0; i < DPI_BUF_CLASSES; ++i){
+        dpi_caches[i] = kmem_cache_create(dpi_cache_names[i], DPI_BUF_MIN_SIZE << (2 * i), 0, 0, NULL);
+        if (!dpi_caches[i]){
+            printk(KERN_ERR "Error creating dpi buffer cache.\n");
+            while (--i >= 0)
+                kmem_cache_destroy(dpi_caches[i]);
+            vfree(dpi_ac);
+            return -ENOMEM;
+        }
+    }
+    for (id = DPI_NONE + 1; id < DPI_INSPECTORS; ++id){
+        dpi_inspectors[id].stats = alloc_percpu(struct dpi_stats);
+        if (!dpi_inspectors[id].stats){
+            printk(KERN_ERR "Error allocating dpi counters.\n");
+            err = -ENOMEM;
+            goto fail;
+        }
+    }
+    major_number = safe_device_init(DEVICE_NAME_DPI, &fops, dev, dpi_attrs);
+    // Since we use safe_device_init, in case of failure all device cleanup will be
+    // handled already, we only need to release the rest
+    if (major_number < 0){
+        err = major_number;
+        goto fail;
+    }
+    return 0;
+fail:
+    free_dpi_stats();
+    for (i = 0; i < DPI_BUF_CLASSES; ++i)
+        kmem_cache_destroy(dpi_caches[i]);
+    vfree(dpi_ac);
+    return err;
+}
+
+/* cleanup the dpi module */
+void cleanup_dpi(void){
+    int i;
+#ifdef DEBUG
+    printk(KERN_DEBUG "Cleaning up dpi buffer pool\n");
+#endif
+    safe_device_cleanup(major_number, 3, dev, dpi_attrs);
+    free_dpi_stats();
+    for (i = 0; i < DPI_BUF_CLASSES; ++i)
+        kmem_cache_destroy(dpi_caches[i]);
+    vfree(dpi_ac);
+}
@@ -0,0 +1,145 @@
+#ifndef FW_DPI_H
+#define FW_DPI_H
+
+#define DEVICE_NAME_DPI             "dpi"
+
+/* Line buffers are allocated from a pool of DPI_BUF_CLASSES size classes,
+ * starting at DPI_BUF_MIN_SIZE bytes and growing 4 times with each class.
+ * A line longer than the largest class is cut: its first DPI_LINE_HEAD chars
+ * are kept, and the rest is checked in parts by the inspector's partial
+ * handler, keeping the last DPI_LINE_OVERLAP chars of each part so patterns on
+ * the cut are not missed. Once the line ends, the handler gets its head.
+ */
+#define DPI_BUF_CLASSES 3
+#define DPI_BUF_MIN_SIZE 256
+#define DPI_LINE_OVERLAP 300 // longer than any signature followed by a host name
+#define DPI_LINE_HEAD 300 // longer than any command or header name followed by its value
+/* Maximal length of the part of a line a handler copies to parse it */
+#define DPI_FTP_CMD_MAX 64
+/* Time (in seconds) without packets after which a connection in the middle of
+ * a line is closed, releasing its buffer.
+ */
+#define DPI_BUF_IDLE_TIMEOUT 10
+
+/* A line buffer. It is only attached to a connection while there is a line
+ * spanning several packets, and returned to the pool once the line is checked.
+ */
+struct dpi_buf {
+    __u8 size_class;
+    __u8 cut; // the line was cut, only its head and the chars after the last part are kept
+    unsigned short len; // number of chars of the line read so far
+    char data[];
+};
+
+/* The inspected data is reassembled by sequence number before it is read.
+ * Retransmitted data is skipped, and segments that arrive before the data
+ * preceding them are copied and held until it arrives. At most
+ * DPI_SEGS_MAX_BYTES are held per connection, further out of order segments
+ * are dropped so the sender retransmits them.
+ */
+#define DPI_SEGS_MAX_BYTES 8192
+
+struct dpi_seg {
+    struct dpi_seg *next;
+    u32 seq; // sequence number of the first byte
+    unsigned int len;
+    unsigned char data[];
+};
+
+/* Verdict of parse_packet for a packet that should be dropped without
+ * blocking the connection, so the sender retransmits it. The stream is left at
+ * the start of the line that couldn't be read, so it is read again from the
+ * retransmission.
+ */
+#define DPI_RETRY (NF_MAX_VERDICT + 1)
+
+/* A handler checks one line of len chars of a connection's data and returns
+ * the verdict, NF_ACCEPT or NF_DROP. It may also return DPI_RETRY, without
+ * changing the connection's state, to check the line again once the packet is
+ * retransmitted. The line is not null-terminated, and
+ * usually points straight into the packet, so it must not be changed.
+ * A line ends with "\r\n", '\r', '\n' or '\0'. Blank lines are passed as well,
+ * so handlers can track the protocol's headers.
+ * A handler may set con->dpi_left to read the next bytes as a length-delimited
+ * part, like an http body. Lines in the part also end where the part ends, and
+ * the handler sees con->dpi_left drop to 0 on the last line of the part - which
+ * may be empty. Blank lines inside the part are not passed.
+ */
+typedef __u8 (*dpi_handler)(connection *con, char *line, unsigned int len);
+
+/* The inspectors, each wrapping a handler. Every destination port is mapped
+ * to the inspector of the data sent to it, or to DPI_NONE if it isn't
+ * inspected. The map can be changed through sysfs. A connection keeps the
+ * inspector its port had when the connection was added, as its inspection
+ * state belongs to that inspector.
+ */
+typedef enum {
+    DPI_NONE,
+    DPI_HTTP,
+    DPI_FTP,
+    DPI_SMTP,
+    DPI_INSPECTORS
+} dpi_id;
+
+/* Per-cpu inspector counters */
+struct dpi_stats {
+    u64 bytes; // bytes of data read
+    u64 lines; // lines checked by the handler
+    u64 time;  // time spent reading data, in nanoseconds
+    u64 drops; // lines the handler dropped
+    u64 exhausted; // connections that used up their budget
+};
+
+/* An inspector may have a partial handler, which checks the parts of a line
+ * that was cut. It only looks for signatures and must not change the
+ * connection's state, as the handler still gets the head of the line once it ends.
+ * An inspector may also have a reply handler, for the data the server sends
+ * back. Replies are not reassembled - each packet's lines are checked on their
+ * own - and don't count toward the budget.
+ */
+#define DPI_REPLY_MAX 256
+
+/* An inspector can be given a budget per connection - it only reads the first
+ * budget bytes of the connection's data, and if headers_only is set, only the
+ * lines before the first empty line (the HTTP or mail headers). Once the budget
+ * is used up the connection is accepted on the fast path.
+ */
+struct dpi_inspector {
+    const char *name;
+    dpi_handler handler;
+    dpi_handler partial_handler; // checks the parts of a cut line, NULL if they aren't checked
+    dpi_handler reply_handler; // checks the data the server sends, NULL if it isn't inspected
+    unsigned int budget; // bytes to inspect per connection, 0 for no limit
+    __u8 headers_only;
+    struct dpi_stats __percpu *stats;
+};
+
+/* Deep packet inspection public interface */
+
+/* get the id of the inspector of data sent to a port, DPI_NONE if it isn't inspected */
+dpi_id dpi_port_id(__be16 dst_port);
+/* get the inspector with the given id, or NULL for DPI_NONE */
+struct dpi_inspector * dpi_get_inspector(dpi_id id);
+/* read a packet's data line by line, in stream order, and check it is valid according to the inspector.
+ * The data starts data_off bytes into the skb, which may be non-linear.
+ * returns NF_ACCEPT, NF_DROP to block the connection, or DPI_RETRY to only drop the packet.
+ */
+__u8 parse_packet(connection * con, struct tcphdr *tcp_header, struct sk_buff *skb,
+                  unsigned int data_off, struct dpi_inspector *insp);
+/* check a packet the server sent, whose data starts data_off bytes into the skb, with the inspector's reply handler.
+ * returns NF_ACCEPT, NF_DROP to block the connection, or DPI_RETRY to only drop the packet.
+ */
+__u8 parse_reply(connection *con, struct sk_buff *skb, unsigned int data_off, struct dpi_inspector *insp);
+/* return the connection's line buffer to the pool, if it has one.
+ * Must be called with the connection's dpi_lock held, or when no one else can use it.
+ */
+void release_dpi_buf(connection *con);
+/* release all of the connection's inspection state, when no one else can use it */
+void release_dpi(connection *con);
+
+/*module init*/
+int init_dpi(void);
+/*module cleanup*/
+void cleanup_dpi(void);
+
+#endif
@@ -0,0 +1,193 @@
+#include "fw.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Tomer Brisker");
+
+/*****************************
+ * Connection events module  *
+ *****************************/
+
+/* The events are written to a ring, and every open file of the device reads
+ * it from its own position. Writers never wait for readers - a reader that is
+ * too slow finds its events overwritten, and sees the gap in the event numbers.
+ * The ring is guarded by events_lock, which is taken inside the connection
+ * table locks and must not be held while taking any other lock.
+ */
+static conn_event_t *events_ring; // the events ring, allocated on init
+static u32 events_head; // number of the next event, its slot is events_head % CONN_EVENTS_SIZE
+static DEFINE_SPINLOCK(events_lock); // guards the ring and events_head
+static DECLARE_WAIT_QUEUE_HEAD(events_wait); // readers waiting for new events
+static atomic_t events_readers; // number of open files, no events are written without readers
+
+/* The state of an open conn_events device */
+struct events_reader {
+    u32 seq; // number of the next event to read
+    conn_event_t events[CONN_EVENTS_BATCH]; // events are copied here before they are copied to the user
+};
+
+/* publish an event for a connection */
+void conn_event(conn_event_type type, connection *con){
+    conn_event_t *event;
+    if (!atomic_read(&events_readers)) //no one is listening
+        return;
+    spin_lock_bh(&events_lock);
+    event = &events_ring[events_head & (CONN_EVENTS_SIZE - 1)];
+    event->version   = CONN_EVENT_VERSION;
+    event->type      = type;
+    event->src_state = con->src_state;
+    event->dst_state = con->dst_state;
+    event->seq       = events_head++;
+    event->src_ip    = con->src_ip;
+    event->dst_ip    = con->dst_ip;
+    event->src_port  = con->src_port;
+    event->dst_port  = con->dst_port;
+    event->created   = con->created;
+    event->timestamp = con->timestamp;
+    event->packets   = atomic64_read(&con->packets);
+    event->bytes     = atomic64_read(&con->bytes);
+    spin_unlock_bh(&events_lock);
+    smp_mb(); // make sure waiting readers see the new head before we check for them
+    if (waitqueue_active(&events_wait))
+        wake_up_interruptible(&events_wait);
+}
+
+/* conn_events char device functions and handlers */
+/*************************************************/
+
+static int major_number;
+static struct device *dev = NULL;
+
+/* open the events device, the reader gets the events from now on */
+static int open_events(struct inode *_inode, struct file *filp){
+    struct events_reader *reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+#ifdef DEBUG
+    printk(KERN_DEBUG "opened conn_events\n");
+#endif
+    if (!reader)
+        return -ENOMEM;
+    spin_lock_bh(&events_lock);
+    reader->seq = events_head;
+    spin_unlock_bh(&events_lock);
+    atomic_inc(&events_readers);
+    filp->private_data = reader;
+    return 0;
+}
+
+/* release the events device */
+static int release_events(struct inode *_inode, struct file *filp){
+    atomic_dec(&events_readers);
+    kfree(filp->private_data);
+    return 0;
+}
+
+/* check if there are events the reader didn't read yet */
+static int events_pending(struct events_reader *reader){
+    return ACCESS_ONCE(events_head) != reader->seq;
+}
+
+/* copy up to max of the reader's pending events to its buffer.
+ * returns the number of events copied.
+ */
+static size_t fetch_events(struct events_reader *reader, size_t max){
+    size_t count, i;
+    spin_lock_bh(&events_lock);
+    if (events_head - reader->seq > CONN_EVENTS_SIZE) //we fell behind, skip the overwritten events
+        reader->seq = events_head - CONN_EVENTS_SIZE;
+    count = min_t(size_t, events_head - reader->seq, max);
+    for (i = 0; i < count; ++i)
+        reader->events[i] = events_ring[(reader->seq + i) & (CONN_EVENTS_SIZE - 1)];
+    reader->seq += count;
+    spin_unlock_bh(&events_lock);
+    return count;
+}
+
+/* read as many whole events as fit in the buffer, waiting for an event if there are none */
+static ssize_t read_events(struct file *filp, char *buff, size_t length, loff_t *offp){
+    struct events_reader *reader = filp->private_data;
+    size_t max = length / sizeof(conn_event_t), total = 0, count;
+    if (!max){ // length must be at least one event for read to work, we don't send partial events.
+        return -ENOMEM;
+    }
+    while (!events_pending(reader)){
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(events_wait, events_pending(reader)))
+            return -ERESTARTSYS;
+    }
+    while (total < max){
+        count = fetch_events(reader, min_t(size_t, max - total, CONN_EVENTS_BATCH));
+        if (!count)
+            break;
+        if (copy_to_user(buff + total * sizeof(conn_event_t), reader->events, count * sizeof(conn_event_t))){
+            return -EFAULT;
+        }
+        total += count;
+    }
+    return total * sizeof(conn_event_t);
+}
+
+/* poll the events device, it is readable when there are pending events */
+static unsigned int poll_events(struct file *filp, poll_table *wait){
+    struct events_reader *reader = filp->private_data;
+    poll_wait(filp, &events_wait, wait);
+    return events_pending(reader) ? (POLLIN | POLLRDNORM) : 0;
+}
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = open_events,
+    .release = release_events,
+    .read = read_events,
+    .poll = poll_events
+};
+
+/* conn_events sysfs functions and attributes */
+/**********************************************/
+
+/* sysfs attribute to show the number of events published so far */
+static ssize_t show_events(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%u\n", ACCESS_ONCE(events_head));
+}
+
+/* sysfs attribute to show the number of open readers */
+static ssize_t show_readers(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&events_readers));
+}
+
+/* sysfs attributes */
+static struct device_attribute events_attrs[]= {
+        __ATTR(events, S_IRUSR, show_events, NULL),
+        __ATTR(readers, S_IRUSR, show_readers, NULL),
+        __ATTR_NULL // stopping condition for loop in device_add_attributes()
+    };
+
+/* initialize the conn_events module */
+int init_events(void){
+#ifdef DEBUG
+    printk(KERN_DEBUG "initializing conn_events device\n");
+#endif
+    events_ring = vmalloc(sizeof(conn_event_t) * CONN_EVENTS_SIZE);
+    if (!events_ring){
+        printk(KERN_ERR "Error allocating memory for connection events.\n");
+        return -ENOMEM;
+    }
+    events_head = 0;
+    atomic_set(&events_readers, 0);
+    major_number = safe_device_init(DEVICE_NAME_CONN_EVENTS, &fops, dev, events_attrs);
+    // Since we use safe_device_init, in case of failure all device cleanup will be
+    // handled already, we only need to release the ring
+    if (major_number < 0){
+        vfree(events_ring);
+        return major_number;
+    }
+    return 0;
+}
+
+/* cleanup the conn_events module */
+void cleanup_events(void){
+#ifdef DEBUG
+    printk(KERN_DEBUG "Cleaning up conn_events device\n");
+#endif
+    safe_device_cleanup(major_number, 3, dev, events_attrs);
+    vfree(events_ring);
+}
@@ -0,0 +1,52 @@
+#ifndef FW_EVENTS_H
+#define FW_EVENTS_H
+
+#define DEVICE_NAME_CONN_EVENTS     "conn_events"
+
+/* Connection lifecycle events */
+typedef enum {
+    CONN_EVENT_NEW          = 1, // a connection was added to the table
+    CONN_EVENT_ESTABLISHED  = 2, // a connection completed the handshake
+    CONN_EVENT_BLOCKED      = 3, // a connection was closed by the inspection
+    CONN_EVENT_EXPIRED      = 4, // a closed or timed out connection was removed by the gc
+    CONN_EVENT_EVICTED      = 5, // a connection was removed to make room for a new one
+} conn_event_type;
+
+/* An event as read from the conn_events device. Like conn_record_t, the layout
+ * is fixed - any change must bump CONN_EVENT_VERSION.
+ */
+#define CONN_EVENT_VERSION 2
+typedef struct {
+    __u8   version;   // CONN_EVENT_VERSION
+    __u8   type;      // values from conn_event_type
+    __u8   src_state; // the connection states after the event, values from conn_state
+    __u8   dst_state;
+    __u32  seq;       // events are numbered in order, a gap means the reader lost events
+    __be32 src_ip;
+    __be32 dst_ip;
+    __be16 src_port;
+    __be16 dst_port;
+    __u32  created;   // time the connection was added, in seconds
+    __u32  timestamp; // last packet seen, in seconds
+    __u64  packets;   // packets seen in both directions, since version 2
+    __u64  bytes;     // bytes seen in both directions, since version 2
+} __attribute__((packed)) conn_event_t;
+
+/* Events are kept in a ring of CONN_EVENTS_SIZE events (must be a power of 2).
+ * A reader that falls behind by more than that loses the oldest events.
+ * Readers get the events in batches of up to CONN_EVENTS_BATCH.
+ */
+#define CONN_EVENTS_SIZE 4096
+#define CONN_EVENTS_BATCH 64
+
+/* Connection events public interface */
+
+/* publish an event for a connection. Cheap when no one is reading the events. */
+void conn_event(conn_event_type type, connection *con);
+
+/*module init*/
+int init_events(void);
+/*module cleanup*/
+void cleanup_events(void);
+
+#endif
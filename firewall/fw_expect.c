@@ -0,0 +1,202 @@
+#include "fw.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Tomer Brisker");
+
+/****************************
+ * FTP expectations module  *
+ ****************************/
+
+/* An ftp data connection is announced on the control connection before it is
+ * opened - by a PORT command in active mode, or by a PASV/EPSV reply in passive
+ * mode. The announcement is kept here as an expectation, so the data
+ * connection's syn is accepted without matching a rule, and the connection is
+ * then tracked in the connection table like any other.
+ * An expectation is bound to the source port of the first syn that meets it,
+ * so the same syn is still accepted in the other hook or when retransmitted,
+ * until the expectation times out.
+ *
+ * Lookups are lockless, under rcu_read_lock(). Changes are done under
+ * expect_lock, which is taken inside the connection table and dpi locks.
+ * The control connection keeps a list of its expectations, which are removed
+ * when it is freed.
+ */
+struct ftp_expect {
+    struct hlist_node node; // chain in the expectations table
+    struct hlist_node master_node; // in the control connection's list
+    struct rcu_head rcu; // used for freeing the expectation after all readers are done with it
+    connection *master; // the control connection that announced it
+    __be32 client_ip;
+    __be32 server_ip;
+    __be16 port; // the port the data connection is opened to
+    __be16 src_port; // the source port of the data connection once its syn was seen, 0 before
+    __u8 passive; // the client opens the data connection, otherwise the server does from port 20
+    unsigned long timestamp; // time of the announcement - for timeout calculations
+};
+
+static struct hlist_head expect_table[FTP_EXPECT_SIZE]; // the expectations, hashed by their key
+static DEFINE_SPINLOCK(expect_lock); // guards the table and the control connections' lists
+static atomic_t expect_count; // number of expectations, syns are only looked up if there are any
+static u32 expect_hash_rnd; // random hash seed, so remote hosts can't predict our buckets
+unsigned int ftp_expect_timeout; // seconds an expectation is kept
+
+/* get the bucket of an expectation key */
+static struct hlist_head * expect_bucket(__be32 client_ip, __be32 server_ip, __be16 port){
+    return &expect_table[jhash_3words(client_ip, server_ip, port, expect_hash_rnd) & (FTP_EXPECT_SIZE - 1)];
+}
+
+/* check if an expectation timed out */
+static int expect_expired(struct ftp_expect *exp, unsigned long now){
+    return now - exp->timestamp > ftp_expect_timeout;
+}
+
+/* remove an expectation and free it once all readers are done with it.
+ * Must be called with expect_lock held.
+ */
+static void del_expect(struct ftp_expect *exp){
+    hlist_del_init_rcu(&exp->node); // mark as unhashed for writers that found it without the lock
+    hlist_del(&exp->master_node);
+    --exp->master->ftp_expect_count;
+    atomic_dec(&expect_count);
+    kfree_rcu(exp, rcu);
+}
+
+/* expect an ftp data connection to port - on the client from the server's port 20
+ * in active mode, or on the server from the client in passive mode. An announcement
+ * that is repeated replaces the old expectation, and if the control connection has
+ * too many, its oldest one is replaced.
+ * Must be called under rcu_read_lock(), with the control connection found in the table.
+ * returns 0 on success
+ */
+int new_ftp_expect(connection *ftp, __be16 port, int passive){
+    struct ftp_expect *exp, *cur, *oldest = NULL;
+    struct hlist_node *tmp;
+    unsigned long now = get_seconds();
+    exp = kmalloc(sizeof(struct ftp_expect), GFP_ATOMIC);
+    if (!exp){
+        printk(KERN_ERR "Error allocating memory for ftp expectation.\n");
+        return -ENOMEM;
+    }
+    exp->master    = ftp;
+    exp->client_ip = ftp->src_ip;
+    exp->server_ip = ftp->dst_ip;
+    exp->port      = port;
+    exp->src_port  = 0;
+    exp->passive   = passive;
+    exp->timestamp = now;
+    spin_lock_bh(&expect_lock);
+    hlist_for_each_entry_safe(cur, tmp, &ftp->ftp_expects, master_node){
+        if (expect_expired(cur, now) || (cur->port == port && cur->passive == passive))
+            del_expect(cur);
+        else if (!oldest || time_before(cur->timestamp, oldest->timestamp))
+            oldest = cur;
+    }
+    if (ftp->ftp_expect_count >= FTP_EXPECT_MAX)
+        del_expect(oldest);
+    hlist_add_head_rcu(&exp->node, expect_bucket(exp->client_ip, exp->server_ip, port));
+    hlist_add_head(&exp->master_node, &ftp->ftp_expects);
+    ++ftp->ftp_expect_count;
+    atomic_inc(&expect_count);
+    spin_unlock_bh(&expect_lock);
+#ifdef DEBUG
+    printk(KERN_DEBUG "Expecting %s ftp data connection: client %pI4 server %pI4 port %u\n",
+           passive ? "passive" : "active", &exp->client_ip, &exp->server_ip, ntohs(port));
+#endif
+    return 0;
+}
+
+/* find a live expectation. Must be called under rcu_read_lock() */
+static struct ftp_expect * find_expect(__be32 client_ip, __be32 server_ip, __be16 port,
+                                       __be16 src_port, int passive, unsigned long now){
+    struct ftp_expect *exp;
+    hlist_for_each_entry_rcu(exp, expect_bucket(client_ip, server_ip, port), node){
+        if (exp->client_ip == client_ip && exp->server_ip == server_ip && exp->port == port &&
+            exp->passive == passive && (!exp->src_port || exp->src_port == src_port) &&
+            !expect_expired(exp, now))
+            return exp;
+    }
+    return NULL;
+}
+
+/* check if a syn opens an expected ftp data connection. An expectation that
+ * wasn't met yet is bound to the syn's source port.
+ * returns 1 if the syn was expected.
+ */
+int ftp_expect_match(rule_t *pkt){
+    struct ftp_expect *exp;
+    unsigned long now = get_seconds();
+    int expected = 0;
+    if (!atomic_read(&expect_count)) //most syns stop here
+        return 0;
+    rcu_read_lock();
+    //passive mode - the client connects to the server
+    exp = find_expect(pkt->src_ip, pkt->dst_ip, pkt->dst_port, pkt->src_port, 1, now);
+    //active mode - the server connects to the client from port 20
+    if (!exp && pkt->src_port == htons(20))
+        exp = find_expect(pkt->dst_ip, pkt->src_ip, pkt->dst_port, pkt->src_port, 0, now);
+    if (exp){
+        spin_lock_bh(&expect_lock);
+        if (!hlist_unhashed(&exp->node) && (!exp->src_port || exp->src_port == pkt->src_port)){
+            exp->src_port = pkt->src_port; //only this connection may use it from now on
+            expected = 1;
+        }
+        spin_unlock_bh(&expect_lock);
+    }
+    rcu_read_unlock();
+    return expected;
+}
+
+/* remove the expectations of an ftp control connection, when no one else can use it */
+void release_ftp_expects(connection *ftp){
+    struct ftp_expect *exp;
+    struct hlist_node *tmp;
+    if (hlist_empty(&ftp->ftp_expects))
+        return;
+    spin_lock_bh(&expect_lock);
+    hlist_for_each_entry_safe(exp, tmp, &ftp->ftp_expects, master_node){
+        del_expect(exp);
+    }
+    spin_unlock_bh(&expect_lock);
+}
+
+/* remove timed out expectations */
+void expire_ftp_expects(unsigned long now){
+    struct ftp_expect *exp;
+    struct hlist_node *tmp;
+    int i;
+    if (!atomic_read(&expect_count))
+        return;
+    spin_lock_bh(&expect_lock);
+    for (i = 0; i < FTP_EXPECT_SIZE; ++i){
+        hlist_for_each_entry_safe(exp, tmp, &expect_table[i], node){
+            if (expect_expired(exp, now))
+                del_expect(exp);
+        }
+    }
+    spin_unlock_bh(&expect_lock);
+}
+
+/* get the number of current expectations */
+int ftp_expects_count(void){
+    return atomic_read(&expect_count);
+}
+
+/* initialize the ftp expectations module */
+int init_expect(void){
+#ifdef DEBUG
+    printk(KERN_DEBUG "initializing ftp expectations\n");
+#endif
+    get_random_bytes(&expect_hash_rnd, sizeof(expect_hash_rnd));
+    atomic_set(&expect_count, 0);
+    ftp_expect_timeout = FTP_EXPECT_TIMEOUT;
+    return 0;
+}
+
+/* cleanup the ftp expectations module. The expectations are released with
+ * their control connections, when the connection table is cleared.
+ */
+void cleanup_expect(void){
+#ifdef DEBUG
+    printk(KERN_DEBUG "Cleaning up ftp expectations\n");
+#endif
+}
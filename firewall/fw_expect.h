@@ -0,0 +1,41 @@
+#ifndef FW_EXPECT_H
+#define FW_EXPECT_H
+
+/* FTP data connections are expected in a hash table of FTP_EXPECT_SIZE
+ * buckets, separate from the connection table, until the data connection's
+ * syn arrives or the expectation times out after ftp_expect_timeout seconds.
+ * Each control connection may have FTP_EXPECT_MAX expectations, a new one
+ * replaces its oldest.
+ */
+#define FTP_EXPECT_SIZE 256
+#define FTP_EXPECT_MAX 4
+#define FTP_EXPECT_TIMEOUT 10
+
+extern unsigned int ftp_expect_timeout; //extern so conn_tab can set it through sysfs
+
+/* FTP expectations public interface */
+
+/* expect an ftp data connection to port - on the client from the server's port 20
+ * in active mode, or on the server from the client in passive mode. A control
+ * connection that already has FTP_EXPECT_MAX expectations loses its oldest one.
+ * returns 0 on success, or -ENOMEM
+ */
+int new_ftp_expect(connection *ftp, __be16 port, int passive);
+/* check if a syn opens an expected ftp data connection. The expectation is
+ * kept until it times out, but the first syn binds it to its source port, so
+ * only retransmits of that syn match it again. returns 1 if there was one.
+ */
+int ftp_expect_match(rule_t *pkt);
+/* remove the expectations of an ftp control connection, when no one else can use it */
+void release_ftp_expects(connection *ftp);
+/* remove timed out expectations */
+void expire_ftp_expects(unsigned long now);
+/* get the number of current expectations */
+int ftp_expects_count(void);
+
+/*module init*/
+int init_expect(void);
+/*module cleanup*/
+void cleanup_expect(void);
+
+#endif
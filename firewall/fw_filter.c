@@ -19,24 +19,39 @@ static direction_t parse_direction(const struct net_device *in, const struct net
     return DIRECTION_ANY;
 }
 
-/* Parse the packet's ip header to get ip addresses and protocol */
-static char parse_ip_hdr(rule_t *pkt, struct sk_buff *skb){
-    struct iphdr *ip_header = ip_hdr(skb);
+/* Parse the packet's ip header to get ip addresses and protocol.
+ * The headers are read with skb_header_pointer, so they may be in the skb's
+ * fragments. The transport header is not used, as it isn't set yet before routing.
+ * returns the offset of the transport header in the skb, or 0 if the ip header is malformed.
+ */
+static unsigned int parse_ip_hdr(rule_t *pkt, struct sk_buff *skb){
+    struct iphdr ip_buf, *ip_header;
+    ip_header = skb_header_pointer(skb, skb_network_offset(skb), sizeof(ip_buf), &ip_buf);
+    if (!ip_header || ip_header->ihl < 5)
+        return 0;
     pkt->src_ip = ip_header->saddr;
     pkt->dst_ip = ip_header->daddr;
     pkt->protocol = ip_header->protocol;
-    // check if the transport header still points to the network header and we
-    // need to set offset. Loosely inspired by
-    // http://stackoverflow.com/questions/29656012/netfilter-like-kernel-module-to-get-source-and-destination-address/
-    if ((unsigned char*)ip_header == skb_transport_header(skb))
-        return ip_header->ihl * 4;
-    return 0;
+    return skb_network_offset(skb) + ip_header->ihl * 4;
 }
 
-/* Parse the packet's tcp header to get ports and check flags */
-/* returns REASON_XMAS_PACKET in case the packet matches the xmas pattern */
-static reason_t parse_tcp_hdr(rule_t *pkt, struct sk_buff *skb, char offset, unsigned int hooknum){
-    struct tcphdr *tcp_header = (struct tcphdr *)(skb_transport_header(skb)+offset);
+/* check that the tcp header at offset in the skb is sane - it isn't truncated,
+ * its options fit in the packet, and the data doesn't overlap it.
+ */
+static int valid_tcp_hdr(struct sk_buff *skb, struct tcphdr *tcp_header, unsigned int offset){
+    return tcp_header && tcp_header->doff >= 5 && offset + tcp_header->doff * 4 <= skb->len;
+}
+
+/* Parse the packet's tcp header to get ports and check flags.
+ * tcp_header is a copy of the header at offset in the skb, or NULL if it is truncated.
+ * returns REASON_XMAS_PACKET in case the packet matches the xmas pattern
+ */
+static reason_t parse_tcp_hdr(rule_t *pkt, struct sk_buff *skb, struct tcphdr *tcp_header,
+                              unsigned int offset, unsigned int hooknum){
+    if (!valid_tcp_hdr(skb, tcp_header, offset)){
+        pkt->action = NF_DROP;
+        return REASON_ILLEGAL_VALUE;
+    }
     pkt->src_port = tcp_header->source;
     pkt->dst_port = tcp_header->dest;
     if (!fw_active) // if firewall is inactive we only need the ports for logging.
@@ -48,19 +63,22 @@ static reason_t parse_tcp_hdr(rule_t *pkt, struct sk_buff *skb, char offset, uns
         pkt->action = NF_DROP;
         return REASON_XMAS_PACKET;
     }
-    if (tcp_header->ack || pkt->src_port == htons(20)){ //established connection or ftp syn
-        return check_conn_tab(pkt, tcp_header, hooknum, skb_tail_pointer(skb));
+    if (tcp_header->ack){ //established connection
+        return check_conn_tab(pkt, tcp_header, hooknum, skb, offset + tcp_header->doff * 4);
     }
     if (!tcp_header->syn){ //if ack=0, this is the first packet and must have syn=1
         pkt->action = NF_DROP;
         return REASON_TCP_NON_COMPLIANT;
     }
-    return 0;
+    return check_ftp_data_syn(pkt, tcp_header, hooknum); //expected ftp data connections skip the rules
 }
 
-/* Parse the packet's udp header to get ports */
-static void parse_udp_hdr(rule_t *pkt, struct sk_buff *skb, char offset){
-    struct udphdr *udp_header = (struct udphdr *)(skb_transport_header(skb)+offset);
+/* Parse the packet's udp header at offset in the skb to get ports */
+static void parse_udp_hdr(rule_t *pkt, struct sk_buff *skb, unsigned int offset){
+    struct udphdr udp_buf, *udp_header;
+    udp_header = skb_header_pointer(skb, offset, sizeof(udp_buf), &udp_buf);
+    if (!udp_header) //truncated packet, leave the ports as any
+        return;
     pkt->src_port = udp_header->source;
     pkt->dst_port = udp_header->dest;
 }
@@ -77,7 +95,8 @@ static unsigned int filter(unsigned int hooknum,
         .src_port = PORT_ANY, //set this for protocols w/o ports
         .dst_port = PORT_ANY
     };
-    char offset = 0;
+    struct tcphdr tcp_buf, *tcp_header = NULL; // the tcp header, copied if it isn't linear
+    unsigned int offset = 0;
     reason_t reason = 0;
 #ifdef DEBUG
     printk(KERN_DEBUG "filter triggered, hooknum: %d, in: %s, out: %s, network protocol:%d\n",
@@ -90,16 +109,31 @@ static unsigned int filter(unsigned int hooknum,
 
     pkt.direction = parse_direction(in, out);
     offset = parse_ip_hdr(&pkt, skb);
+    if (!offset){ //malformed ip header
+        pkt.protocol = PROT_OTHER;
+        pkt.action = NF_DROP;
+        reason = REASON_ILLEGAL_VALUE;
+    }
 #ifdef DEBUG
     printk(KERN_DEBUG "ip packet, src: %pI4, dst: %pI4, transport protocol:%d\n", &pkt.src_ip, &pkt.dst_ip, pkt.protocol);
 #endif
+    if (pkt.protocol == PROT_TCP)
+        tcp_header = skb_header_pointer(skb, offset, sizeof(tcp_buf), &tcp_buf);
+
+    // packets of established connections that are not inspected are accepted right away,
+    // they are counted in their connection instead of being logged. Malformed headers are
+    // left for parse_tcp_hdr to drop
+    if (valid_tcp_hdr(skb, tcp_header, offset) && fw_active && conn_fast_path(&pkt, tcp_header, hooknum, skb->len)){
+        ++p_pass;
+        return NF_ACCEPT;
+    }
 
     // get the ports for the log, and handle more complex tcp checks on the way
     switch (pkt.protocol){
     case PROT_ICMP: //ICMP has no ports
         break;
     case PROT_TCP:
-        reason = parse_tcp_hdr(&pkt, skb, offset, hooknum); //check the connection tab when parsing
+        reason = parse_tcp_hdr(&pkt, skb, tcp_header, offset, hooknum); //check the connection tab when parsing
         break;
     case PROT_UDP:
         parse_udp_hdr(&pkt, skb, offset);
@@ -113,14 +147,14 @@ static unsigned int filter(unsigned int hooknum,
         pkt.action = NF_ACCEPT;
     }
     //make the routing decision based on the rules, only check if we didn't set reason yet
-    reason = reason ? reason : check_packet(&pkt);
+    reason = reason ? reason : check_packet(&pkt, skb->len);
     //log the packet
     log_row(pkt.protocol, pkt.action, hooknum, pkt.src_ip, pkt.dst_ip,
             pkt.src_port, pkt.dst_port, reason);
     //print the decision to the kernel log, update counter and return decision.
     if (pkt.action == NF_ACCEPT){
-        if (pkt.protocol == PROT_TCP && pkt.ack == ACK_NO && pkt.src_port != htons(20) && pkt.dst_port != htons(20))
-            new_connection(pkt, hooknum); // add a new connection to the connection tab
+        if (tcp_header && pkt.ack == ACK_NO && reason != REASON_CONN_EXIST)
+            new_connection(pkt, tcp_header, hooknum); // add a new connection to the connection tab
         PASS_AND_RET;
     }
     DROP_AND_RET;
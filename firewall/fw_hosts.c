@@ -7,80 +7,514 @@ MODULE_AUTHOR("Tomer Brisker");
  * Blocked hosts module *
  ************************/
 
-/* Internal list representation and helper functions */
-/*****************************************************/
+/* Internal set representation and helper functions */
+/****************************************************/
 
-static char * host_list; //the blocked host list provided by the user. we just copy it from the user.
-static int host_len; // the length of the list
+/* A host in the set. The entries are packed into chunks, so a set of hundreds
+ * of thousands of hosts is built and freed without an allocation per host.
+ */
+struct host_entry {
+    struct host_entry *next; // next entry in the bucket
+    u32 hash;
+    __u8 len;
+    __u8 wildcard; // the entry is "*.name", it matches the subdomains of name
+    char name[]; // lower case, not null-terminated, without the "*."
+};
+
+struct host_chunk {
+    struct host_chunk *next;
+    unsigned long used; // bytes of data used by entries, keeps the data aligned for them
+    char data[];
+};
+
+/* A set of blocked hosts. A set isn't changed once it is published, readers
+ * only need rcu_read_lock() to use it.
+ */
+struct host_set {
+    u32 gen; // generation of the set, verdicts cached for older sets are ignored
+    unsigned int bits; // the set has 2^bits buckets
+    unsigned int count; // number of hosts in the set
+    unsigned int wildcards; // number of wildcard hosts, suffixes are only looked up if there are any
+    struct host_entry **buckets;
+    struct host_chunk *chunks;
+};
+
+/* A cached verdict */
+struct hosts_cache_entry {
+    u32 gen; // generation of the set the verdict was found in
+    u32 hash;
+    __u8 len;
+    __u8 blocked;
+    char name[HOSTS_CACHE_NAME_MAX]; // as it was looked up, not null-terminated
+};
+
+struct hosts_cache {
+    struct hosts_cache_entry entries[HOSTS_CACHE_SIZE];
+    u64 hits;
+    u64 misses;
+};
+
+static struct host_set __rcu *hosts; // the current set, NULL before a list is loaded
+static DEFINE_MUTEX(hosts_mutex); // serializes replacing the set with listing it
+static u32 hosts_gen; // generation of the last set, guarded by hosts_mutex
+static u32 hosts_hash_rnd; // random hash seed, so remote hosts can't predict our buckets
+static DEFINE_PER_CPU(struct hosts_cache, hosts_cache);
+
+/* add the char before a suffix to the suffix's hash, ignoring case (FNV-1a) */
+static u32 host_hash_step(u32 hash, char c){
+    return (hash ^ (unsigned char)tolower(c)) * 16777619;
+}
+
+/* hash a name from its last char to its first. The hash of every suffix of the
+ * name is found on the way, so a host's domains are hashed in one pass.
+ */
+static u32 host_hash(const char *name, unsigned int len){
+    u32 hash = hosts_hash_rnd;
+    while (len--)
+        hash = host_hash_step(hash, name[len]);
+    return hash;
+}
+
+/* get the bucket of a hash in a table of 2^bits buckets. The top bits of the hash are mixed best */
+static unsigned int host_bucket(u32 hash, unsigned int bits){
+    return hash >> (32 - bits);
+}
 
-/* check if a given host is on the blocked hosts list */
-int check_hosts(char *host){
-    char *tmp;
-    int len = 0;
-    if (host_list == NULL || host == NULL){
+/* find a host or a wildcard host in a set. returns its entry or NULL if it isn't in the set */
+static struct host_entry * find_host(struct host_set *set, const char *name, unsigned int len,
+                                     u32 hash, int wildcard){
+    struct host_entry *cur;
+    for (cur = set->buckets[host_bucket(hash, set->bits)]; cur; cur = cur->next){
+        if (cur->hash == hash && cur->len == len && cur->wildcard == wildcard &&
+            !strncasecmp(cur->name, name, len))
+            return cur;
+    }
+    return NULL;
+}
+
+/* allocate an empty set */
+static struct host_set * alloc_host_set(void){
+    struct host_set *set = kzalloc(sizeof(struct host_set), GFP_KERNEL);
+    if (!set)
+        return NULL;
+    set->bits = HOSTS_HASH_MIN_BITS;
+    set->buckets = vzalloc(sizeof(struct host_entry *) << set->bits);
+    if (!set->buckets){
+        kfree(set);
+        return NULL;
+    }
+    return set;
+}
+
+/* free a set that no one else can use */
+static void free_host_set(struct host_set *set){
+    struct host_chunk *chunk, *next;
+    if (!set)
+        return;
+    for (chunk = set->chunks; chunk; chunk = next){
+        next = chunk->next;
+        vfree(chunk);
+    }
+    vfree(set->buckets);
+    kfree(set);
+}
+
+/* double the number of buckets of a set that is being built */
+static int grow_host_set(struct host_set *set){
+    unsigned int bits = set->bits + 1, i;
+    struct host_entry **buckets, *cur, *next;
+    buckets = vzalloc(sizeof(struct host_entry *) << bits);
+    if (!buckets)
+        return -ENOMEM;
+    for (i = 0; i < (1U << set->bits); ++i){
+        for (cur = set->buckets[i]; cur; cur = next){ //the hash is kept, so moving an entry is cheap
+            next = cur->next;
+            cur->next = buckets[host_bucket(cur->hash, bits)];
+            buckets[host_bucket(cur->hash, bits)] = cur;
+        }
+    }
+    vfree(set->buckets);
+    set->buckets = buckets;
+    set->bits = bits;
+    return 0;
+}
+
+/* get room for an entry of a len chars name from the set's chunks */
+static struct host_entry * alloc_host_entry(struct host_set *set, unsigned int len){
+    unsigned int size = ALIGN(sizeof(struct host_entry) + len, sizeof(void *));
+    struct host_chunk *chunk = set->chunks;
+    struct host_entry *entry;
+    if (!chunk || chunk->used + size > HOSTS_CHUNK_SIZE - sizeof(struct host_chunk)){
+        chunk = vmalloc(HOSTS_CHUNK_SIZE);
+        if (!chunk)
+            return NULL;
+        chunk->used = 0;
+        chunk->next = set->chunks;
+        set->chunks = chunk;
+    }
+    entry = (struct host_entry *)(chunk->data + chunk->used);
+    chunk->used += size;
+    return entry;
+}
+
+/* add a host or a wildcard host to a set that is being built, unless it is already there */
+static int add_host(struct host_set *set, const char *name, unsigned int len, int wildcard){
+    u32 hash = host_hash(name, len);
+    struct host_entry *entry, **bucket;
+    unsigned int i;
+    if (find_host(set, name, len, hash, wildcard))
         return 0;
+    //keep the chains short, up to the largest table
+    if (set->count >= (1U << set->bits) && set->bits < HOSTS_HASH_MAX_BITS && grow_host_set(set))
+        return -ENOMEM;
+    entry = alloc_host_entry(set, len);
+    if (!entry)
+        return -ENOMEM;
+    entry->hash = hash;
+    entry->len = len;
+    entry->wildcard = wildcard;
+    for (i = 0; i < len; ++i)
+        entry->name[i] = tolower(name[i]);
+    bucket = &set->buckets[host_bucket(hash, set->bits)];
+    entry->next = *bucket;
+    *bucket = entry;
+    ++set->count;
+    set->wildcards += wildcard;
+    return 0;
+}
+
+/* get the length of the name in a Host header value - without a port, a
+ * trailing dot or trailing whitespace.
+ */
+static unsigned int host_name_len(const char *host, unsigned int len){
+    unsigned int i;
+    while (len && isspace(host[len - 1]))
+        --len;
+    for (i = len; i--;){ //cut the port, unless the colon is inside an ipv6 literal
+        if (host[i] == ':'){
+            len = i;
+            break;
+        }
+        if (!isdigit(host[i]))
+            break;
     }
-    tmp = strstr(host_list, host);
-    len = strlen(host);
-    while (tmp){
-        //make sure we have a complete match
-        if ((tmp==host_list || tmp[-1] == '\n') &&
-            (tmp[len] == '\n' || tmp[len] == '\r' || tmp[len] == '\0')){
-#ifdef DEBUG
-            printk(KERN_DEBUG "Blocked host: %s\n", host);
-#endif
+    if (len && host[len - 1] == '.')
+        --len;
+    return len;
+}
+
+/* look a host up in a set - the name itself, and the domains it belongs to in
+ * the wildcard hosts. The name is hashed once, right to left, and the hash of
+ * each domain is kept as the pass reaches its dot, so the lookup costs one
+ * probe per label whatever the size of the set.
+ * returns 1 if the host is blocked.
+ */
+static int match_host(struct host_set *set, const char *name, unsigned int len, u32 hash,
+                      const u32 *domain_hashes, const unsigned char *domain_starts, unsigned int domains){
+    unsigned int i;
+    if (find_host(set, name, len, hash, 0))
+        return 1;
+    for (i = 0; i < domains; ++i){
+        if (find_host(set, name + domain_starts[i], len - domain_starts[i], domain_hashes[i], 1))
             return 1;
-        }
-        tmp = strstr(tmp+1, host);
     }
     return 0;
 }
 
-/* hosts list sysfs device functions and handlers */
-/**************************************************/
+/* check if a given host, as it appears in a Host header, is on the blocked hosts list */
+int check_hosts(const char *host, unsigned int len){
+    struct hosts_cache *cache;
+    struct hosts_cache_entry *cached;
+    struct host_set *set;
+    u32 hash, domain_hashes[HOSTS_LABELS_MAX]; //the hash of each domain of the host, shortest first
+    unsigned char domain_starts[HOSTS_LABELS_MAX];
+    unsigned int domains = 0, i;
+    int blocked;
+    if (host == NULL){
+        return 0;
+    }
+    len = host_name_len(host, len);
+    if (!len || len > HOSTS_NAME_MAX) //can't be on the list
+        return 0;
+    rcu_read_lock();
+    set = rcu_dereference(hosts);
+    if (!set || !set->count){
+        rcu_read_unlock();
+        return 0;
+    }
+    hash = hosts_hash_rnd;
+    for (i = len; i--;){
+        hash = host_hash_step(hash, host[i]);
+        if (i && host[i - 1] == '.' && domains < HOSTS_LABELS_MAX){ //a domain of the host starts at i
+            domain_hashes[domains] = hash;
+            domain_starts[domains++] = i;
+        }
+    }
+    if (!set->wildcards)
+        domains = 0;
+    cache = this_cpu_ptr(&hosts_cache);
+    cached = &cache->entries[host_bucket(hash, HOSTS_CACHE_BITS)];
+    if (cached->gen == set->gen && cached->hash == hash && cached->len == len &&
+        !strncasecmp(cached->name, host, len)){
+        blocked = cached->blocked;
+        ++cache->hits;
+    } else {
+        blocked = match_host(set, host, len, hash, domain_hashes, domain_starts, domains);
+        ++cache->misses;
+        if (len <= HOSTS_CACHE_NAME_MAX){
+            cached->gen     = set->gen;
+            cached->hash    = hash;
+            cached->len     = len;
+            cached->blocked = blocked;
+            memcpy(cached->name, host, len);
+        }
+    }
+    rcu_read_unlock();
+#ifdef DEBUG
+    if (blocked)
+        printk(KERN_DEBUG "Blocked host: %.*s\n", len, host);
+#endif
+    return blocked;
+}
+
+/* replace the current set with a new one, and free the old one once no one uses it */
+static void replace_hosts(struct host_set *set){
+    struct host_set *old;
+    mutex_lock(&hosts_mutex);
+    old = rcu_dereference_protected(hosts, lockdep_is_held(&hosts_mutex));
+    set->gen = ++hosts_gen;
+    rcu_assign_pointer(hosts, set);
+    mutex_unlock(&hosts_mutex);
+#ifdef DEBUG
+    printk(KERN_DEBUG "loaded %u blocked hosts\n", set->count);
+#endif
+    synchronize_rcu(); //the chunks are vmalloc'ed, so they can't be freed from an rcu callback
+    free_host_set(old);
+}
+
+/* hosts list char device functions and handlers */
+/*************************************************/
 
 static int major_number;
 static struct device *dev = NULL;
-static struct file_operations fops = {
-    .owner = THIS_MODULE
+
+/* The state of an open hosts device. A file opened for writing loads a new
+ * set, which replaces the current one when the file is closed if it was
+ * written to or truncated. A file that wasn't written to lists the current
+ * set with its own cursor, like the connection table - if the set is replaced
+ * during the listing some hosts may be skipped or repeated.
+ */
+struct hosts_file {
+    struct host_set *set; // the set being loaded, NULL for readers
+    int err; // the first error of the load, the set is dropped if there was one
+    int written; // data was written, so the set replaces the current one
+    unsigned int line_len; // chars in line of a line that continues in the next write
+    unsigned int bucket, pos; // the read cursor
+    char line[HOSTS_NAME_MAX + 3]; // room for a wildcard's "*." and a newline when listing
+    char buf[HOSTS_WRITE_BATCH]; // written data is copied from the user in batches
 };
 
-/* show the blocked host list to the user */
-static ssize_t show_hosts(struct device *dev, struct device_attribute *attr, char *buf){
+/* open the hosts char device */
+static int open_hosts(struct inode *_inode, struct file *filp){
+    struct hosts_file *file;
 #ifdef DEBUG
-    printk(KERN_DEBUG "showing hosts, length %d\n", host_len);
+    printk(KERN_DEBUG "opened hosts\n");
 #endif
-    if (host_list == NULL)
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    if (filp->f_mode & FMODE_WRITE){
+        file->set = alloc_host_set();
+        if (!file->set){
+            kfree(file);
+            return -ENOMEM;
+        }
+    }
+    filp->private_data = file;
+    return 0;
+}
+
+/* add a host name of the list to the set being loaded */
+static int load_host_name(struct host_set *set, const char *name, unsigned int len, int wildcard){
+    if (!len) //skip empty lines
         return 0;
-    return scnprintf(buf, host_len+1, "%s\n", host_list);
+    if (len > HOSTS_NAME_MAX){
+        printk(KERN_ERR "Host name too long: %.32s...\n", name);
+        return -EINVAL;
+    }
+    return add_host(set, name, len, wildcard);
+}
+
+/* add a line of the list to the set being loaded, without its surrounding whitespace */
+static int load_host_line(struct host_set *set, const char *line, unsigned int len){
+    while (len && isspace(*line)){
+        ++line;
+        --len;
+    }
+    while (len && isspace(line[len - 1]))
+        --len;
+    if (len && line[len - 1] == '.') //a fully qualified name is the same host
+        --len;
+    if (len > 2 && line[0] == '*' && line[1] == '.') //a wildcard host
+        return load_host_name(set, line + 2, len - 2, 1);
+    return load_host_name(set, line, len, 0);
+}
+
+/* keep the part of a line that continues in the next write */
+static int keep_host_line(struct hosts_file *file, const char *chars, unsigned int len){
+    if (file->line_len + len > sizeof(file->line)){
+        printk(KERN_ERR "Host name too long: %.32s...\n", file->line);
+        return -EINVAL;
+    }
+    memcpy(file->line + file->line_len, chars, len);
+    file->line_len += len;
+    return 0;
 }
 
-/* load a blocked host list from the user */
-static ssize_t set_hosts(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
-    host_len = count;
+/* load the lines of a batch of written data. The first line may continue a
+ * line of an earlier write, and the last one may continue in the next write.
+ */
+static int load_hosts_batch(struct hosts_file *file, char *start, char *end){
+    char *newline;
+    int err;
+    while ((newline = memchr(start, '\n', end - start))){
+        if (file->line_len){ //complete the line of the earlier write
+            err = keep_host_line(file, start, newline - start);
+            if (!err)
+                err = load_host_line(file->set, file->line, file->line_len);
+            file->line_len = 0;
+        } else { //a whole line, load it from the batch
+            err = load_host_line(file->set, start, newline - start);
+        }
+        if (err)
+            return err;
+        start = newline + 1;
+    }
+    return keep_host_line(file, start, end - start);
+}
+
+/* load part of a hosts list, the list may be written in any number of writes */
+static ssize_t write_hosts(struct file *filp, const char *buff, size_t length, loff_t *offp){
+    struct hosts_file *file = filp->private_data;
+    size_t done = 0, count;
 #ifdef DEBUG
-    printk(KERN_DEBUG "setting hosts, length %d\n", count);
+    printk(KERN_DEBUG "write hosts, length: %d\n", length);
 #endif
-    if (host_list != NULL)
-        kfree(host_list);
-    host_list = kmalloc(host_len, GFP_KERNEL);
-    if (host_list == NULL){
-        printk(KERN_ERR "kmalloc for host list failed\n");
-        host_len = 0;
-        return -ENOMEM;
+    if (file->err) //the load already failed
+        return file->err;
+    file->written = 1;
+    while (done < length){
+        count = min_t(size_t, length - done, sizeof(file->buf));
+        if (copy_from_user(file->buf, buff + done, count)){
+            file->err = -EFAULT;
+            return -EFAULT;
+        }
+        file->err = load_hosts_batch(file, file->buf, file->buf + count);
+        if (file->err)
+            return file->err;
+        done += count;
+    }
+    return length;
+}
+
+/* list the current set, as many whole lines as fit in the buffer */
+static ssize_t read_hosts(struct file *filp, char *buff, size_t length, loff_t *offp){
+    struct hosts_file *file = filp->private_data;
+    struct host_set *set;
+    struct host_entry *cur;
+    unsigned int pos, line_len;
+    ssize_t total = 0;
+    if (file->written) //the file is used for loading a list
+        return -EINVAL;
+    mutex_lock(&hosts_mutex); //the set can't be freed while we hold this
+    set = rcu_dereference_protected(hosts, lockdep_is_held(&hosts_mutex));
+    while (set && file->bucket < (1U << set->bits)){
+        pos = 0;
+        for (cur = set->buckets[file->bucket]; cur; cur = cur->next){
+            if (pos++ < file->pos) //already read
+                continue;
+            line_len = (cur->wildcard ? 2 : 0) + cur->len + 1;
+            if (total + line_len > length){ //we don't send partial lines
+                if (!total)
+                    total = -ENOMEM;
+                goto out;
+            }
+            memcpy(file->line, "*.", 2);
+            memcpy(file->line + line_len - 1 - cur->len, cur->name, cur->len);
+            file->line[line_len - 1] = '\n';
+            if (copy_to_user(buff + total, file->line, line_len)){
+                total = -EFAULT;
+                goto out;
+            }
+            total += line_len;
+            file->pos = pos;
+        }
+        ++file->bucket; //continue to the next bucket
+        file->pos = 0;
     }
-    if (scnprintf(host_list, host_len, "%s", buf)<0){
-        printk(KERN_ERR "Error copying string from userspace");
-        kfree(host_list);
-        host_len = 0;
-        return -EFAULT;
+out:
+    mutex_unlock(&hosts_mutex);
+    return total;
+}
+
+/* release the hosts char device. A list that was loaded without errors replaces the current one */
+static int release_hosts(struct inode *_inode, struct file *filp){
+    struct hosts_file *file = filp->private_data;
+    if (file->set && !file->written && !(filp->f_flags & O_TRUNC)){ //nothing was loaded
+        free_host_set(file->set);
+    } else if (file->set){
+        if (!file->err && file->line_len) //the last line doesn't have to end with a newline
+            file->err = load_host_line(file->set, file->line, file->line_len);
+        if (file->err){
+            printk(KERN_ERR "Error loading hosts list, keeping the current list\n");
+            free_host_set(file->set);
+        } else {
+            replace_hosts(file->set);
+        }
+    }
+    kfree(file);
+    return 0;
+}
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = open_hosts,
+    .release = release_hosts,
+    .read = read_hosts,
+    .write = write_hosts
+};
+
+/* hosts sysfs functions and attributes */
+/****************************************/
+
+/* sysfs attribute to show the number of blocked hosts */
+static ssize_t show_hosts_count(struct device *dev, struct device_attribute *attr, char *buf){
+    struct host_set *set;
+    unsigned int count;
+    rcu_read_lock();
+    set = rcu_dereference(hosts);
+    count = set ? set->count : 0;
+    rcu_read_unlock();
+    return scnprintf(buf, PAGE_SIZE, "%u\n", count);
+}
+
+/* sysfs attribute to show the verdict cache hits and misses, summed over all cpus */
+static ssize_t show_cache(struct device *dev, struct device_attribute *attr, char *buf){
+    struct hosts_cache *cache;
+    u64 hits = 0, misses = 0;
+    int cpu;
+    for_each_possible_cpu(cpu){
+        cache = per_cpu_ptr(&hosts_cache, cpu);
+        hits += cache->hits;
+        misses += cache->misses;
     }
-    return count;
+    return scnprintf(buf, PAGE_SIZE, "%llu %llu\n", hits, misses);
 }
 
 /* Array of device attributes to set for the device. */
 static struct device_attribute hosts_attrs[]= {
-    __ATTR(hosts, S_IRUSR | S_IWUSR, show_hosts, set_hosts),
+    __ATTR(hosts_count, S_IRUSR, show_hosts_count, NULL),
+    __ATTR(cache, S_IRUSR, show_cache, NULL),
     __ATTR_NULL // stopping condition for loop in device_add_attributes()
 };
 
@@ -89,8 +523,9 @@ int init_hosts(void){
 #ifdef DEBUG
     printk(KERN_DEBUG "initializing hosts device\n");
 #endif
-    host_list = NULL;
-    host_len = 0;
+    RCU_INIT_POINTER(hosts, NULL);
+    hosts_gen = 0;
+    get_random_bytes(&hosts_hash_rnd, sizeof(hosts_hash_rnd));
     major_number = safe_device_init(DEVICE_NAME_HOSTS, &fops, dev, hosts_attrs);
     // Since we use safe_device_init, in case of failure all cleanup will be
     // handled already, only need to return 0 for non-negative major (=no error)
@@ -103,6 +538,7 @@ void cleanup_hosts(void){
     printk(KERN_DEBUG "Cleaning up hosts device\n");
 #endif
     safe_device_cleanup(major_number, 3, dev, hosts_attrs);
-    if (host_list != NULL)
-        kfree(host_list);
+    synchronize_rcu(); //the filter is already unregistered, wait for the last lookups
+    free_host_set(rcu_dereference_protected(hosts, 1));
+    RCU_INIT_POINTER(hosts, NULL);
 }
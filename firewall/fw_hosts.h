@@ -3,10 +3,39 @@
 
 #define DEVICE_NAME_HOSTS "hosts"
 
+/* The blocked hosts are kept in a hash set, built from a list the user writes
+ * to the hosts char device - one host per line, in as many writes as needed.
+ * The new set replaces the old one when the device is closed, and only if the
+ * whole list was loaded. A file that wasn't written to only replaces it if it
+ * was opened with O_TRUNC, so an empty list clears the set but a file opened
+ * for reading and writing leaves it alone. Reading the device lists the
+ * current set.
+ * A line "*.example.com" is a wildcard host, blocking every subdomain of
+ * example.com (but not example.com itself).
+ * Names are compared case-insensitively, and hashed from their last char to
+ * their first, so the hashes of all the domains of a host are found in one pass.
+ */
+#define HOSTS_NAME_MAX 255 // the longest host name we keep
+#define HOSTS_LABELS_MAX (HOSTS_NAME_MAX / 2) // a host has at most this many domains above it
+#define HOSTS_HASH_MIN_BITS 10
+#define HOSTS_HASH_MAX_BITS 20
+#define HOSTS_CHUNK_SIZE (64 * 1024) // the names are stored in chunks of this many bytes
+#define HOSTS_WRITE_BATCH 1024 // written data is copied from the user in batches of this many bytes
+
+/* Recent verdicts are cached per cpu, in a small direct-mapped cache indexed by
+ * the name's hash. Names longer than HOSTS_CACHE_NAME_MAX are not cached.
+ */
+#define HOSTS_CACHE_BITS 6
+#define HOSTS_CACHE_SIZE (1 << HOSTS_CACHE_BITS)
+#define HOSTS_CACHE_NAME_MAX 54
+
 /* Blocked host list module public interface */
 
-/* check if a given host is in the blocked list */
-int check_hosts(char *host);
+/* check if a host is in the blocked list, directly or by a wildcard. The host
+ * is a Host header value of len chars, any port and trailing dot are ignored.
+ * Must be called with bh disabled.
+ */
+int check_hosts(const char *host, unsigned int len);
 
 /*init and cleanup the module and its device */
 int init_hosts(void);
@@ -9,8 +9,37 @@ MODULE_AUTHOR("Tomer Brisker");
 
 char fw_active; // 0 = deactivated, 1 = activated
 
-static rule_t rule_list[MAX_RULES]; //array of rules
-static int rule_count; //number of rules in the list
+/* The hits of each rule, counted per cpu so matching packets never write to a
+ * shared cache line. They are summed when the user asks for them.
+ */
+struct rule_stats {
+    u64 packets;
+    u64 bytes;
+    unsigned long last_hit; // seconds, 0 if the rule was never hit
+};
+
+/* A rule list is loaded as a generation - the rules and their compiled form,
+ * allocated at the size of the list. A generation isn't changed once it is
+ * published, a new list replaces it as a whole, so a packet always sees one
+ * complete rule list.
+ */
+struct rule_gen {
+    struct rule_classifier *cls; // the compiled rules
+    struct rule_stats __percpu *stats; // the hits of each rule
+    rule_counter_t *carried; // hits counted by earlier generations, when the list was edited, or NULL
+    unsigned int count; // number of rules
+    rule_t rules[];
+};
+
+static struct rule_gen __rcu *rule_gen; //the current rules, NULL when the list is empty
+static DEFINE_MUTEX(rules_mutex); //serializes replacing the rules with reading them
+static rule_engine_t rule_engine; //how packets are matched against the rules
+
+/* the names of the engines, for sysfs */
+static const char *rule_engine_names[RULE_ENGINES] = {
+    [RULE_ENGINE_COMPILED] = "compiled",
+    [RULE_ENGINE_LINEAR]   = "linear"
+};
 
 /* returns true if packet_ip is not in the network defined by rule_ip/nps */
 static int check_rule_ip(__be32 rule_ip, __be32 packet_ip, __u8 nps){
@@ -24,7 +53,7 @@ static int check_rule_port(__be32 rule_port, __be32 packet_port){
             (rule_port == PORT_ABOVE_1023 && packet_port < PORT_ABOVE_1023));
 }
 
-/* check if a packet represented as a rule matches the given rule */
+/* check if a packet represented as a rule matches the given rule - used by the linear engine */
 static int check_rule(rule_t *packet, rule_t rule){
     if (rule.protocol != PROT_ANY && rule.protocol != packet->protocol)
         return 0;
@@ -34,10 +63,15 @@ static int check_rule(rule_t *packet, rule_t rule){
     if (check_rule_ip(rule.src_ip, packet->src_ip, rule.src_prefix_size) ||
         check_rule_ip(rule.dst_ip, packet->dst_ip, rule.dst_prefix_size))
         return 0;
+    if ((rule.src_ip_set && !ip_set_match(rule.src_ip_set, packet->src_ip)) ||
+        (rule.dst_ip_set && !ip_set_match(rule.dst_ip_set, packet->dst_ip)))
+        return 0;
 
     if ((packet->protocol == PROT_TCP || packet->protocol == PROT_UDP) && //only check ports for protocols that have one
         (check_rule_port(rule.src_port, packet->src_port) ||
-         check_rule_port(rule.dst_port, packet->dst_port)))
+         check_rule_port(rule.dst_port, packet->dst_port) ||
+         (rule.src_port_set && !port_set_match(rule.src_port_set, packet->src_port)) ||
+         (rule.dst_port_set && !port_set_match(rule.dst_port_set, packet->dst_port))))
         return 0;
     //only check ack for TCP
     if (packet->protocol == PROT_TCP && rule.ack != ACK_ANY && rule.ack != packet->ack)
@@ -47,17 +81,76 @@ static int check_rule(rule_t *packet, rule_t rule){
     return 1;
 }
 
-/* Compare a packet represented as a rule against the rule list.
- * If a rule is matched return its number, or REASON_NO_MATCHING_RULE otherwise
+/* Compare a packet of len bytes represented as a rule against the rule list.
+ * If a rule is matched count the hit and return its number, or REASON_NO_MATCHING_RULE otherwise
  */
-reason_t check_packet(rule_t *packet){
-    int i;
+reason_t check_packet(rule_t *packet, unsigned int len){
+    struct rule_gen *gen;
+    reason_t reason = REASON_NO_MATCHING_RULE;
+    unsigned int i;
 
-    for (i = 0; i < rule_count; ++i){
-        if (check_rule(packet, rule_list[i]))
-            return i;
+    rcu_read_lock();
+    gen = rcu_dereference(rule_gen);
+    if (gen && ACCESS_ONCE(rule_engine) == RULE_ENGINE_LINEAR){ //the reference engine, try the rules in order
+        for (i = 0; i < gen->count; ++i){
+            if (check_rule(packet, gen->rules[i])){
+                reason = i;
+                break;
+            }
+        }
+    } else if (gen){
+        reason = classify_packet(gen->cls, packet);
+    }
+    if (reason != REASON_NO_MATCHING_RULE){
+        this_cpu_inc(gen->stats[reason].packets);
+        this_cpu_add(gen->stats[reason].bytes, len);
+        this_cpu_write(gen->stats[reason].last_hit, get_seconds());
     }
-    return REASON_NO_MATCHING_RULE;
+    rcu_read_unlock();
+    return reason;
+}
+
+/* free a generation that no one else can use */
+static void free_rule_gen(struct rule_gen *gen){
+    if (!gen)
+        return;
+    free_classifier(gen->cls);
+    free_percpu(gen->stats);
+    vfree(gen->carried);
+    vfree(gen);
+}
+
+/* allocate a generation of count rules, with no hits. returns NULL if we are out of memory */
+static struct rule_gen * alloc_rule_gen(unsigned int count){
+    struct rule_gen *gen = vmalloc(sizeof(struct rule_gen) + count * RULE_SIZE);
+    if (!gen)
+        return NULL;
+    gen->count = count;
+    gen->cls = NULL;
+    gen->carried = NULL;
+    gen->stats = __alloc_percpu(count * sizeof(struct rule_stats), __alignof__(struct rule_stats));
+    if (!gen->stats){
+        vfree(gen);
+        return NULL;
+    }
+    return gen;
+}
+
+/* publish a new generation, or NULL for an empty list, and free the old one
+ * once the packets that use it are done. Only the caller waits for them, the
+ * packets never wait for a reload.
+ */
+static void replace_rule_gen(struct rule_gen *gen){
+    struct rule_gen *old;
+    mutex_lock(&rules_mutex);
+    old = rcu_dereference_protected(rule_gen, lockdep_is_held(&rules_mutex));
+    rcu_assign_pointer(rule_gen, gen);
+    mutex_unlock(&rules_mutex);
+#ifdef DEBUG
+    printk(KERN_DEBUG "loaded %u rules\n", gen ? gen->count : 0);
+#endif
+    synchronize_rcu(); //the generation is vmalloc'ed, so it can't be freed from an rcu callback
+    free_rule_gen(old);
 }
 
 /* verify that a rule given by the user is valid */
@@ -75,6 +168,15 @@ static int invalid_rule(rule_t rule){
         return -1;
     if (rule.action != NF_ACCEPT && rule.action != NF_DROP)
         return -1;
+    //a rule uses a set instead of its field, so the field must match anything
+    if (rule.src_ip_set && (rule.src_ip || rule.src_prefix_size || get_set_type(rule.src_ip_set) != SET_IP))
+        return -1;
+    if (rule.dst_ip_set && (rule.dst_ip || rule.dst_prefix_size || get_set_type(rule.dst_ip_set) != SET_IP))
+        return -1;
+    if (rule.src_port_set && (rule.src_port != PORT_ANY || get_set_type(rule.src_port_set) != SET_PORT))
+        return -1;
+    if (rule.dst_port_set && (rule.dst_port != PORT_ANY || get_set_type(rule.dst_port_set) != SET_PORT))
+        return -1;
     return 0;
 }
 
@@ -94,30 +196,35 @@ static struct device *dev = NULL;
 
 /* send the complete rule list to the user */
 static ssize_t read_rules(struct file *filp, char *buff, size_t length, loff_t *offp){
+    struct rule_gen *gen;
+    ssize_t ret;
 #ifdef DEBUG
-    printk(KERN_DEBUG "read rules, length: %d, size: %d\n", length, sizeof(rule_list));
+    printk(KERN_DEBUG "read rules, length: %d\n", length);
 #endif
-    if (!rule_count){ //the rule list is empty
-        return 0;
-    }
-    if (length < RULE_SIZE*rule_count){ // length must be at least RULE_SIZE for read to work.
-        return -ENOMEM;
+    mutex_lock(&rules_mutex); //the generation can't be freed while we hold this
+    gen = rcu_dereference_protected(rule_gen, lockdep_is_held(&rules_mutex));
+    if (!gen){ //the rule list is empty
+        ret = 0;
+    } else if (length < RULE_SIZE*gen->count){ // length must be enough for the whole list
+        ret = -ENOMEM;
+    } else if (copy_to_user(buff, gen->rules, RULE_SIZE*gen->count)){  // Send the data to the user through 'copy_to_user'
+        ret = -EFAULT;
+    } else {
+        ret = RULE_SIZE*gen->count;
     }
-    if (copy_to_user(buff, rule_list, RULE_SIZE*rule_count)){  // Send the data to the user through 'copy_to_user'
-        return -EFAULT;
-    }
-    return RULE_SIZE*rule_count;
+    mutex_unlock(&rules_mutex);
+    return ret;
 }
 
-/* get a complete rule list from the user */
+/* get a complete rule list from the user. The new generation is built, checked
+ * and compiled on the side, and only replaces the current one once it is ready.
+ */
 static ssize_t write_rules(struct file *filp, const char *buff, size_t length, loff_t *offp){
-    // a temporary buffer to get the user input.
-    // defined as static so it is placed in global memory but only visible in this scope,
-    // it is too large for a local variable. (>1024 bytes)
-    static rule_t temp[MAX_RULES];
+    struct rule_gen *gen;
+    unsigned int count = length / RULE_SIZE;
 
 #ifdef DEBUG
-    printk(KERN_DEBUG "write rules, length: %d, size: %d\n", length, sizeof(rule_list));
+    printk(KERN_DEBUG "write rules, length: %d, size: %d\n", length, RULE_SIZE);
 #endif
     if (length > RULE_SIZE*MAX_RULES){ // data is too big
         return -ENOMEM;
@@ -125,30 +232,238 @@ static ssize_t write_rules(struct file *filp, const char *buff, size_t length, l
     if (length % RULE_SIZE != 0) { //bad size - only copy complete rules
         return -EINVAL;
     }
-    if (copy_from_user(temp, buff, length)){  // get the data from userspace
+    if (!count){ //an empty list
+        replace_rule_gen(NULL);
+        return 0;
+    }
+    gen = alloc_rule_gen(count); //a new list starts with no hits
+    if (!gen){
+        printk(KERN_ERR "Error allocating memory for the rules.\n");
+        return -ENOMEM;
+    }
+    if (copy_from_user(gen->rules, buff, length)){  // get the data from userspace
+        free_rule_gen(gen);
         return -EFAULT;
     }
-    if (invalid_ruleset(temp, length / RULE_SIZE)){ //make sure the rules are valid
+    if (invalid_ruleset(gen->rules, count)){ //make sure the rules are valid
+        free_rule_gen(gen);
         return -EINVAL;
     }
-    memcpy(rule_list, temp, length); // override the current list
-    rule_count = length / RULE_SIZE; // update the size
+    gen->cls = compile_rules(gen->rules, count);
+    if (!gen->cls){ //keep the current list if we can't compile
+        printk(KERN_ERR "Error allocating memory for the compiled rules.\n");
+        free_rule_gen(gen);
+        return -ENOMEM;
+    }
+    replace_rule_gen(gen);
     return length;
 }
 
+/* sum the hits of rule i over all the cpus, and the hits carried from earlier generations */
+static void sum_rule_stats(struct rule_gen *gen, unsigned int i, rule_counter_t *counter){
+    struct rule_stats *stats;
+    int cpu;
+    if (gen->carried)
+        *counter = gen->carried[i];
+    else
+        counter->packets = counter->bytes = counter->last_hit = 0;
+    for_each_possible_cpu(cpu){
+        stats = per_cpu_ptr(gen->stats, cpu) + i;
+        counter->packets += stats->packets;
+        counter->bytes += stats->bytes;
+        if (stats->last_hit > counter->last_hit)
+            counter->last_hit = stats->last_hit;
+    }
+}
+
+/* send the counters of the rules to the user, in the order of the rule list.
+ * req.count is the room in req.counters, and is set to the number of rules.
+ */
+static long get_rule_counters(rule_counters_req_t __user *ureq){
+    rule_counters_req_t req;
+    rule_counter_t counters[RULE_COUNTERS_BATCH]; //summed in batches, so the user buffer is written in few copies
+    rule_counter_t __user *dst;
+    struct rule_gen *gen;
+    unsigned int i, k, n, count;
+    long ret = 0;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+    dst = (rule_counter_t __user *)(unsigned long)req.counters;
+    mutex_lock(&rules_mutex); //the generation can't be freed while we hold this
+    gen = rcu_dereference_protected(rule_gen, lockdep_is_held(&rules_mutex));
+    count = gen ? min(gen->count, req.count) : 0;
+    for (i = 0; i < count && !ret; i += n){
+        n = min(count - i, (unsigned int)RULE_COUNTERS_BATCH);
+        for (k = 0; k < n; ++k)
+            sum_rule_stats(gen, i + k, &counters[k]);
+        if (copy_to_user(dst + i, counters, n * sizeof(rule_counter_t)))
+            ret = -EFAULT;
+    }
+    req.count = gen ? gen->count : 0;
+    mutex_unlock(&rules_mutex);
+    if (!ret && copy_to_user(ureq, &req, sizeof(req)))
+        ret = -EFAULT;
+    return ret;
+}
+
+/* find the position of the rule an edit applies to - its index, or the rule
+ * named by it. An insert without an index or name goes at the end.
+ * returns -ENOENT if there is no such rule.
+ */
+static int find_edit_pos(const struct rule_gen *gen, const rule_edit_t *edit){
+    unsigned int count = gen ? gen->count : 0, i;
+    if (edit->index >= 0) //an insert may go after the last rule
+        return edit->index < count + (edit->op == RULE_EDIT_INSERT) ? edit->index : -ENOENT;
+    if (!edit->name[0])
+        return edit->op == RULE_EDIT_INSERT ? count : -ENOENT;
+    for (i = 0; i < count; ++i){
+        if (!strncmp(gen->rules[i].rule_name, edit->name, sizeof(edit->name)))
+            return i;
+    }
+    return -ENOENT;
+}
+
+/* get the position in the edited list of rule i of the list before the edit, or -1 if it was removed */
+static int edited_pos(const rule_edit_t *edit, unsigned int pos, unsigned int i){
+    if (i < pos)
+        return i;
+    if (edit->op == RULE_EDIT_INSERT)
+        return i + 1;
+    if (i == pos) //deleted, or replaced by a new rule that starts with no hits
+        return -1;
+    return edit->op == RULE_EDIT_DELETE ? i - 1 : i;
+}
+
+/* build the list of a generation from the rules of the old one and an edit at pos */
+static void copy_edited_rules(struct rule_gen *gen, const struct rule_gen *old,
+                              const rule_edit_t *edit, unsigned int pos){
+    unsigned int count = old ? old->count : 0, i;
+    int j;
+    for (i = 0; i < count; ++i){
+        j = edited_pos(edit, pos, i);
+        if (j >= 0)
+            gen->rules[j] = old->rules[i];
+    }
+    if (edit->op != RULE_EDIT_DELETE)
+        gen->rules[pos] = edit->rule;
+}
+
+/* insert, delete or replace a single rule. The edited list is built as a new
+ * generation and replaces the current one atomically, like a whole list. The
+ * hits of the rules that stay are carried to the new generation once the
+ * packets that use the old one are done, so none are lost.
+ * returns the position of the edited rule.
+ */
+static long edit_rules(const rule_edit_t __user *uedit){
+    rule_edit_t edit;
+    struct rule_gen *gen = NULL, *old;
+    unsigned int count, i;
+    int pos, j;
+
+    if (copy_from_user(&edit, uedit, sizeof(edit)))
+        return -EFAULT;
+    if (edit.op != RULE_EDIT_INSERT && edit.op != RULE_EDIT_DELETE && edit.op != RULE_EDIT_REPLACE)
+        return -EINVAL;
+    if (edit.op != RULE_EDIT_DELETE && invalid_rule(edit.rule))
+        return -EINVAL;
+
+    mutex_lock(&rules_mutex); //edits are applied one at a time, to the current list
+    old = rcu_dereference_protected(rule_gen, lockdep_is_held(&rules_mutex));
+    count = old ? old->count : 0;
+    pos = find_edit_pos(old, &edit);
+    if (pos < 0)
+        goto out;
+    if (edit.op == RULE_EDIT_INSERT)
+        ++count;
+    else if (edit.op == RULE_EDIT_DELETE)
+        --count;
+    if (count > MAX_RULES){
+        pos = -ENOMEM;
+        goto out;
+    }
+    if (count){ //deleting the last rule leaves an empty list
+        gen = alloc_rule_gen(count);
+        if (gen)
+            gen->carried = vzalloc(count * sizeof(rule_counter_t));
+        if (!gen || !gen->carried){
+            pos = -ENOMEM;
+            goto out;
+        }
+        copy_edited_rules(gen, old, &edit, pos);
+        gen->cls = compile_rules(gen->rules, count);
+        if (!gen->cls){ //keep the current list if we can't compile
+            pos = -ENOMEM;
+            goto out;
+        }
+    }
+    rcu_assign_pointer(rule_gen, gen);
+    //the old counters are only final once no packet uses the old generation
+    synchronize_rcu();
+    for (i = 0; gen && old && i < old->count; ++i){
+        j = edited_pos(&edit, pos, i);
+        if (j >= 0)
+            sum_rule_stats(old, i, &gen->carried[j]);
+    }
+#ifdef DEBUG
+    printk(KERN_DEBUG "edited rule %d, %u rules\n", pos, count);
+#endif
+    gen = old; //free the old generation instead
+out:
+    mutex_unlock(&rules_mutex);
+    free_rule_gen(gen);
+    return pos;
+}
+
+/* rules device ioctls */
+static long ioctl_rules(struct file *filp, unsigned int cmd, unsigned long arg){
+    switch (cmd){
+    case FW_IOC_RULE_COUNTERS:
+        return get_rule_counters((rule_counters_req_t __user *)arg);
+    case FW_IOC_RULE_EDIT:
+        return edit_rules((const rule_edit_t __user *)arg);
+    }
+    return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+/* rules device ioctls of 32 bit processes. The structures have the same layout
+ * for them - the user pointers inside are __u64 - so only arg needs converting.
+ */
+static long compat_ioctl_rules(struct file *filp, unsigned int cmd, unsigned long arg){
+    switch (cmd){
+    case FW_IOC_RULE_COUNTERS:
+    case FW_IOC_RULE_EDIT:
+        return ioctl_rules(filp, cmd, (unsigned long)compat_ptr(arg));
+    }
+    return -ENOIOCTLCMD;
+}
+#endif
+
 // char device operations
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .read = read_rules,
-    .write = write_rules
+    .write = write_rules,
+    .unlocked_ioctl = ioctl_rules,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl = compat_ioctl_rules
+#endif
 };
 
+
 /* log sysfs functions and attributes */
 /**************************************/
 
 /* sysfs attribute to show the number of rules to the user */
 static ssize_t show_size(struct device *dev, struct device_attribute *attr, char *buf){
-    return scnprintf(buf, PAGE_SIZE, "%u\n", rule_count);
+    struct rule_gen *gen;
+    unsigned int count;
+    rcu_read_lock();
+    gen = rcu_dereference(rule_gen);
+    count = gen ? gen->count : 0;
+    rcu_read_unlock();
+    return scnprintf(buf, PAGE_SIZE, "%u\n", count);
 }
 
 /* sysfs attribute to show the current fw activation state to the user */
@@ -172,7 +487,29 @@ static ssize_t set_active(struct device *dev, struct device_attribute *attr, con
 static ssize_t clear_rules(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
     char temp;
     if (sscanf(buf, "%1c", &temp) == 1){
-        rule_count = 0; // no need to actually empty the array, just set the count to 0
+        replace_rule_gen(NULL);
+    }
+    return count;
+}
+
+/* sysfs attribute to show the engine used for matching packets against the rules */
+static ssize_t show_engine(struct device *dev, struct device_attribute *attr, char *buf){
+    return scnprintf(buf, PAGE_SIZE, "%s\n", rule_engine_names[rule_engine]);
+}
+
+/* sysfs attribute to set the engine - "compiled", or "linear" for the reference engine */
+static ssize_t set_engine(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    char name[16];
+    int engine;
+    if (sscanf(buf, "%15s", name) != 1)
+        return count;
+    for (engine = 0; engine < RULE_ENGINES; ++engine){
+        if (!strcmp(name, rule_engine_names[engine])){
+#ifdef DEBUG
+            printk(KERN_DEBUG "setting rule engine to %s\n", name);
+#endif
+            rule_engine = engine;
+        }
     }
     return count;
 }
@@ -182,6 +519,7 @@ static struct device_attribute rule_attrs[]= {
         __ATTR(rules_size, S_IRUSR, show_size, NULL),
         __ATTR(active, S_IWUSR|S_IRUSR, show_active, set_active),
         __ATTR(rules_clear, S_IWUSR, NULL, clear_rules),
+        __ATTR(engine, S_IWUSR|S_IRUSR, show_engine, set_engine),
         __ATTR_NULL // stopping condition for loop in device_add_attributes()
     };
 
@@ -191,7 +529,8 @@ int init_rules(void){
 #ifdef DEBUG
     printk(KERN_DEBUG "initializing rules device\n");
 #endif
-    rule_count = 0;
+    RCU_INIT_POINTER(rule_gen, NULL);
+    rule_engine = RULE_ENGINE_COMPILED;
     fw_active = 0; // start as inactive until activated by user
     major_number = safe_device_init(DEVICE_NAME_RULES, &fops, dev, rule_attrs);
     // Since we use safe_device_init, in case of failure all cleanup will be
@@ -205,4 +544,5 @@ void cleanup_rules(void){
     printk(KERN_DEBUG "Cleaning up rules device\n");
 #endif
     safe_device_cleanup(major_number, 3, dev, rule_attrs);
+    free_rule_gen(rcu_dereference_protected(rule_gen, 1)); //the filter is already unregistered
 }
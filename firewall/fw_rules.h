@@ -7,7 +7,7 @@
 #define IP_VERSION      (4)
 #define PORT_ANY        (0)
 #define PORT_ABOVE_1023 (1023)
-#define MAX_RULES       (50)
+#define MAX_RULES       (8192) // rule lists are allocated at their size, this only bounds the compiled form
 
 // the protocols we will work with
 typedef enum {
@@ -43,8 +43,52 @@ typedef struct {
     __u8    protocol;           // values from: prot_t
     ack_t   ack;                // values from: ack_t
     __u8    action;             // valid values: NF_ACCEPT, NF_DROP
+    __u8    src_ip_set;         // id of an ip set to match instead of src_ip, or 0. src_ip/prefix must be any
+    __u8    dst_ip_set;         // as above
+    __u8    src_port_set;       // id of a port set to match instead of src_port, or 0. src_port must be PORT_ANY
+    __u8    dst_port_set;       // as above
 } rule_t;
 
+// the engines that can match packets against the rules
+typedef enum {
+    RULE_ENGINE_COMPILED, // the compiled classifier (see fw_classify.h)
+    RULE_ENGINE_LINEAR,   // try the rules one by one - the reference for the compiled one
+    RULE_ENGINES
+} rule_engine_t;
+
+// the hits of a rule, as read from the rules device
+typedef struct {
+    __u64   packets;
+    __u64   bytes;
+    __u64   last_hit;           // seconds since the epoch, 0 if the rule was never hit
+} rule_counter_t;
+
+// a request for the counters of all the rules, in the order of the rule list
+typedef struct {
+    __u32   count;              // in: room in counters, out: number of rules
+    __u32   reserved;
+    __u64   counters;           // user pointer to an array of rule_counter_t
+} rule_counters_req_t;
+
+typedef enum {
+    RULE_EDIT_INSERT    = 1,    // insert the rule at the position, moving the rules from it down
+    RULE_EDIT_DELETE    = 2,
+    RULE_EDIT_REPLACE   = 3,    // the new rule starts with no hits
+} rule_edit_op_t;
+
+// a change of a single rule. The rest of the rules keep their hits
+typedef struct {
+    __u32   op;                 // values from rule_edit_op_t
+    __s32   index;              // position of the rule, or -1 to find it by name
+    char    name[20];           // the rule to edit when index is -1. An insert without a name goes at the end
+    rule_t  rule;               // the new rule, for insert and replace
+} rule_edit_t;
+
+#define FW_IOC_MAGIC 'f'
+#define FW_IOC_RULE_COUNTERS _IOWR(FW_IOC_MAGIC, 1, rule_counters_req_t)
+#define FW_IOC_RULE_EDIT _IOW(FW_IOC_MAGIC, 2, rule_edit_t) // returns the position of the edited rule
+#define RULE_COUNTERS_BATCH 16 // counters are copied to the user this many at a time
+
 extern char fw_active; //extern so other modules can see the fw activation state
 
 #define RULE_SIZE sizeof(rule_t)
@@ -52,8 +96,8 @@ extern char fw_active; //extern so other modules can see the fw activation state
  * Firewall rules interface - "public" methods *
  ***********************************************/
 
-/* compares the packet against the rule list */
-reason_t check_packet(rule_t *packet);
+/* compares a packet of len bytes against the rule list and counts the hit */
+reason_t check_packet(rule_t *packet, unsigned int len);
 /* module init */
 int init_rules(void);
 /* module cleanup */
@@ -0,0 +1,343 @@
+#include "fw.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Tomer Brisker");
+
+/*********************
+ * Named sets module *
+ *********************/
+
+/* An address set. Node 0 is the root, each node has SET_TRIE_SLOTS slots.
+ * A set isn't changed once it is published, readers only need rcu_read_lock().
+ */
+struct ip_trie {
+    u32 all; // the set has a /0 network, every address is in it
+    unsigned int nodes;
+    u32 slots[];
+};
+
+struct fw_set {
+    char name[SET_NAME_MAX];
+    set_type_t type; // SET_NONE for a free id
+    unsigned int count; // number of entries the set was loaded with
+    void __rcu *data; // a struct ip_trie or a bitmap of SET_PORTS bits
+};
+
+static struct fw_set sets[SETS_MAX]; // indexed by set id, sets[0] is never used
+static DEFINE_MUTEX(sets_mutex); // serializes replacing the sets with listing them
+
+/* the names of the set types, for sysfs */
+static const char *set_type_names[] = {
+    [SET_NONE] = "none",
+    [SET_IP]   = "ip",
+    [SET_PORT] = "port"
+};
+
+/* Set lookup */
+/**************/
+
+/* get the slot of an address in a node of a given level */
+static unsigned int trie_slot(u32 node, u32 addr, unsigned int level){
+    return node * SET_TRIE_SLOTS + ((addr >> (32 - SET_TRIE_STRIDE * (level + 1))) & (SET_TRIE_SLOTS - 1));
+}
+
+/* check if an address is in an ip set. Must be called under rcu_read_lock() */
+int ip_set_match(unsigned int id, __be32 ip){
+    struct ip_trie *trie = rcu_dereference(sets[id].data);
+    u32 addr = ntohl(ip), slot, node = 0;
+    unsigned int level;
+    if (!trie)
+        return 0;
+    if (trie->all)
+        return 1;
+    for (level = 0; level < 32 / SET_TRIE_STRIDE; ++level){
+        slot = trie->slots[trie_slot(node, addr, level)];
+        if (slot & SET_TRIE_MATCH)
+            return 1;
+        if (!slot) //no network of the set has this prefix
+            return 0;
+        node = slot;
+    }
+    return 0;
+}
+
+/* check if a port, in network order, is in a port set. Must be called under rcu_read_lock() */
+int port_set_match(unsigned int id, __be16 port){
+    unsigned long *ports = rcu_dereference(sets[id].data);
+    return ports && test_bit(ntohs(port), ports);
+}
+
+/* get the type of a set, or SET_NONE if it wasn't loaded */
+set_type_t get_set_type(unsigned int id){
+    set_type_t type = SET_NONE;
+    if (id && id < SETS_MAX){
+        mutex_lock(&sets_mutex);
+        type = sets[id].type;
+        mutex_unlock(&sets_mutex);
+    }
+    return type;
+}
+
+/* Building the sets */
+/*********************/
+
+/* a trie being built, it grows as nodes are added */
+struct trie_builder {
+    u32 *slots;
+    unsigned int nodes;
+    unsigned int capacity; // in nodes
+};
+
+/* add an empty node to a trie being built. returns its number, or -ENOMEM */
+static int trie_new_node(struct trie_builder *b){
+    u32 *slots;
+    if (b->nodes == b->capacity){ //double the room, the nodes are referenced by number so they can move
+        slots = vzalloc(2 * b->capacity * SET_TRIE_SLOTS * sizeof(u32));
+        if (!slots)
+            return -ENOMEM;
+        memcpy(slots, b->slots, b->nodes * SET_TRIE_SLOTS * sizeof(u32));
+        vfree(b->slots);
+        b->slots = slots;
+        b->capacity *= 2;
+    }
+    return b->nodes++;
+}
+
+/* add a network, with a prefix of 1-32 bits, to a trie being built. Shorter
+ * prefixes must be added first, so a slot they cover never has a node below it.
+ */
+static int trie_add(struct trie_builder *b, u32 addr, unsigned int prefix){
+    unsigned int level, last = (prefix - 1) / SET_TRIE_STRIDE, span, first, i;
+    u32 node = 0;
+    int child;
+    for (level = 0; level < last; ++level){
+        i = trie_slot(node, addr, level);
+        if (b->slots[i] & SET_TRIE_MATCH) //a shorter network already covers this one
+            return 0;
+        if (!b->slots[i]){
+            child = trie_new_node(b);
+            if (child < 0)
+                return child;
+            b->slots[i] = child;
+        }
+        node = b->slots[i];
+    }
+    //the prefix ends in this level, cover every slot that starts with its remaining bits
+    span = 1 << (SET_TRIE_STRIDE * (last + 1) - prefix);
+    first = trie_slot(node, addr, last) & ~(span - 1);
+    for (i = 0; i < span; ++i)
+        b->slots[first + i] = SET_TRIE_MATCH;
+    return 0;
+}
+
+/* compare networks by prefix size, for sorting */
+static int cmp_prefix(const void *a, const void *b){
+    return ((const ip_set_entry_t *)a)->prefix_size - ((const ip_set_entry_t *)b)->prefix_size;
+}
+
+/* build the trie of an address set. The entries are sorted. returns NULL if we are out of memory */
+static struct ip_trie * build_ip_trie(ip_set_entry_t *entries, unsigned int count){
+    struct trie_builder b = { .capacity = 16 };
+    struct ip_trie *trie = NULL;
+    unsigned int i, prefix;
+    u32 all = 0;
+
+    b.slots = vzalloc(b.capacity * SET_TRIE_SLOTS * sizeof(u32));
+    if (!b.slots)
+        return NULL;
+    b.nodes = 1; //the root
+    sort(entries, count, sizeof(ip_set_entry_t), cmp_prefix, NULL);
+    for (i = 0; i < count; ++i){
+        prefix = entries[i].prefix_size;
+        if (!prefix){ //a /0 network has every address
+            all = 1;
+            break;
+        }
+        if (trie_add(&b, ntohl(entries[i].ip) & (~0U << (32 - prefix)), prefix))
+            goto out;
+    }
+    //keep only the nodes that were used
+    trie = vmalloc(sizeof(struct ip_trie) + b.nodes * SET_TRIE_SLOTS * sizeof(u32));
+    if (!trie)
+        goto out;
+    trie->all = all;
+    trie->nodes = b.nodes;
+    memcpy(trie->slots, b.slots, b.nodes * SET_TRIE_SLOTS * sizeof(u32));
+#ifdef DEBUG
+    printk(KERN_DEBUG "built ip set of %u networks, %u trie nodes\n", count, b.nodes);
+#endif
+out:
+    vfree(b.slots);
+    return trie;
+}
+
+/* build the bitmap of a port set. returns NULL if we are out of memory */
+static unsigned long * build_port_map(const port_set_entry_t *entries, unsigned int count){
+    unsigned long *ports = vzalloc(BITS_TO_LONGS(SET_PORTS) * sizeof(unsigned long));
+    unsigned int i;
+    if (!ports)
+        return NULL;
+    for (i = 0; i < count; ++i)
+        bitmap_set(ports, entries[i].from, entries[i].to - entries[i].from + 1);
+    return ports;
+}
+
+/* verify that the entries of a set given by the user are valid */
+static int invalid_set_entries(const set_header_t *header, const void *entries){
+    const ip_set_entry_t *ips = entries;
+    const port_set_entry_t *ports = entries;
+    unsigned int i;
+    for (i = 0; i < header->count; ++i){
+        if (header->type == SET_IP && ips[i].prefix_size > 32)
+            return -1;
+        if (header->type == SET_PORT && ports[i].from > ports[i].to)
+            return -1;
+    }
+    return 0;
+}
+
+/* publish a set under its name, replacing the set of that name, and free the
+ * old one once the packets that use it are done.
+ */
+static int replace_set(const set_header_t *header, void *data){
+    unsigned int id, free_id = 0;
+    void *old;
+    mutex_lock(&sets_mutex);
+    for (id = 1; id < SETS_MAX; ++id){
+        if (sets[id].type == SET_NONE && !free_id)
+            free_id = id;
+        if (sets[id].type != SET_NONE && !strcmp(sets[id].name, header->name))
+            break;
+    }
+    if (id == SETS_MAX){ //a new set, give it the first free id
+        if (!free_id){
+            mutex_unlock(&sets_mutex);
+            return -ENOSPC;
+        }
+        id = free_id;
+        memcpy(sets[id].name, header->name, SET_NAME_MAX);
+        sets[id].type = header->type;
+    } else if (sets[id].type != header->type){ //rules may use the set, so its type can't change
+        mutex_unlock(&sets_mutex);
+        return -EINVAL;
+    }
+    old = rcu_dereference_protected(sets[id].data, lockdep_is_held(&sets_mutex));
+    rcu_assign_pointer(sets[id].data, data);
+    sets[id].count = header->count;
+    mutex_unlock(&sets_mutex);
+#ifdef DEBUG
+    printk(KERN_DEBUG "loaded set %u %s, %u entries\n", id, header->name, header->count);
+#endif
+    synchronize_rcu(); //the set is vmalloc'ed, so it can't be freed from an rcu callback
+    vfree(old);
+    return 0;
+}
+
+/* sets char device functions and handlers */
+/*******************************************/
+static int major_number;
+static struct device *dev = NULL;
+
+/* get a complete set from the user - a header and all of its entries. The set
+ * is built on the side, and only replaces the current one once it is ready.
+ */
+static ssize_t write_set(struct file *filp, const char *buff, size_t length, loff_t *offp){
+    set_header_t header;
+    size_t entry_size;
+    void *entries, *data;
+    int err;
+
+#ifdef DEBUG
+    printk(KERN_DEBUG "write set, length: %d\n", length);
+#endif
+    if (length < sizeof(header))
+        return -EINVAL;
+    if (copy_from_user(&header, buff, sizeof(header)))
+        return -EFAULT;
+    if (!header.name[0] || strnlen(header.name, SET_NAME_MAX) == SET_NAME_MAX)
+        return -EINVAL;
+    if (header.type == SET_IP)
+        entry_size = sizeof(ip_set_entry_t);
+    else if (header.type == SET_PORT)
+        entry_size = sizeof(port_set_entry_t);
+    else
+        return -EINVAL;
+    if (header.count > SET_ENTRIES_MAX || length != sizeof(header) + header.count * entry_size)
+        return -EINVAL; //bad size - only take complete sets
+    entries = vmalloc(header.count * entry_size + 1); //an empty set is valid
+    if (!entries)
+        return -ENOMEM;
+    if (copy_from_user(entries, buff + sizeof(header), header.count * entry_size)){
+        vfree(entries);
+        return -EFAULT;
+    }
+    if (invalid_set_entries(&header, entries)){
+        vfree(entries);
+        return -EINVAL;
+    }
+    if (header.type == SET_IP)
+        data = build_ip_trie(entries, header.count);
+    else
+        data = build_port_map(entries, header.count);
+    vfree(entries);
+    if (!data){ //keep the current set if we can't build the new one
+        printk(KERN_ERR "Error allocating memory for set %s.\n", header.name);
+        return -ENOMEM;
+    }
+    err = replace_set(&header, data);
+    if (err){
+        vfree(data);
+        return err;
+    }
+    return length;
+}
+
+// char device operations
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .write = write_set
+};
+
+/* sets sysfs functions and attributes */
+/***************************************/
+
+/* sysfs attribute to list the sets - their id, type, name and number of entries */
+static ssize_t show_sets(struct device *dev, struct device_attribute *attr, char *buf){
+    unsigned int id;
+    ssize_t len = 0;
+    mutex_lock(&sets_mutex);
+    for (id = 1; id < SETS_MAX; ++id){
+        if (sets[id].type != SET_NONE)
+            len += scnprintf(buf + len, PAGE_SIZE - len, "%u %s %s %u\n",
+                             id, set_type_names[sets[id].type], sets[id].name, sets[id].count);
+    }
+    mutex_unlock(&sets_mutex);
+    return len;
+}
+
+/* sysfs attributes */
+static struct device_attribute sets_attrs[]= {
+        __ATTR(sets, S_IRUSR, show_sets, NULL),
+        __ATTR_NULL // stopping condition for loop in device_add_attributes()
+    };
+
+/* initialize the sets module */
+int init_sets(void){
+#ifdef DEBUG
+    printk(KERN_DEBUG "initializing sets device\n");
+#endif
+    memset(sets, 0, sizeof(sets));
+    major_number = safe_device_init(DEVICE_NAME_SETS, &fops, dev, sets_attrs);
+    return (major_number < 0) ? major_number : 0;
+}
+
+/* cleanup the sets module */
+void cleanup_sets(void){
+    unsigned int id;
+#ifdef DEBUG
+    printk(KERN_DEBUG "Cleaning up sets device\n");
+#endif
+    safe_device_cleanup(major_number, 3, dev, sets_attrs);
+    for (id = 1; id < SETS_MAX; ++id) //the filter is already unregistered
+        vfree(rcu_dereference_protected(sets[id].data, 1));
+}
@@ -0,0 +1,69 @@
+#ifndef FW_SETS_H
+#define FW_SETS_H
+
+#define DEVICE_NAME_SETS "sets"
+
+/* Named sets of addresses and ports that rules can use instead of a single
+ * address or port. A set is loaded, or reloaded, on its own by writing it to
+ * the sets char device in a single write: a set_header_t and then count
+ * entries of its type. The new set replaces the set of the same name as a
+ * whole. A name keeps its id, and its type, as long as the module is loaded.
+ * The sets are listed by the sets sysfs attribute.
+ */
+#define SETS_MAX 64 // set ids are 1..SETS_MAX-1, 0 is no set
+#define SET_NAME_MAX 16 // names will be no longer than 15 chars
+#define SET_ENTRIES_MAX (1 << 20)
+
+typedef enum {
+    SET_NONE = 0, // no set with this id was loaded
+    SET_IP   = 1,
+    SET_PORT = 2,
+} set_type_t;
+
+// a set as written to the sets device, followed by its entries
+typedef struct {
+    char    name[SET_NAME_MAX]; // null-terminated
+    __u8    type;               // values from set_type_t
+    __u8    reserved[3];
+    __u32   count;              // number of entries that follow
+} set_header_t;
+
+// an entry of an address set - a network
+typedef struct {
+    __be32  ip;
+    __u8    prefix_size;        // valid values: 0-32
+    __u8    reserved[3];
+} ip_set_entry_t;
+
+// an entry of a port set - a range of ports, in host order
+typedef struct {
+    __u16   from;
+    __u16   to;
+} port_set_entry_t;
+
+/* An address set is a multibit trie, consuming SET_TRIE_STRIDE bits of the
+ * address at each level. A network whose prefix ends inside a level is expanded
+ * to all the slots it covers, and a slot covered by a network doesn't need a
+ * node below it, so a lookup takes at most 32 / SET_TRIE_STRIDE steps and
+ * stops at the first covered slot.
+ * A port set is a bitmap of all the ports.
+ */
+#define SET_TRIE_STRIDE 4
+#define SET_TRIE_SLOTS (1 << SET_TRIE_STRIDE)
+#define SET_TRIE_MATCH 0x80000000 // the slot is covered by a network of the set, otherwise it is the next node or 0
+#define SET_PORTS 65536
+
+/* Named sets module public interface */
+
+/* check if an address is in an ip set. Must be called under rcu_read_lock() */
+int ip_set_match(unsigned int id, __be32 ip);
+/* check if a port, in network order, is in a port set. Must be called under rcu_read_lock() */
+int port_set_match(unsigned int id, __be16 port);
+/* get the type of a set, or SET_NONE if it wasn't loaded */
+set_type_t get_set_type(unsigned int id);
+
+/*init and cleanup the module and its device */
+int init_sets(void);
+void cleanup_sets(void);
+
+#endif
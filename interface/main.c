@@ -39,11 +39,11 @@ void print_rule(rule_t rule){
     printf("%s %s %s %s %s %s %s %s %s\n",
         rule.rule_name,
         dir_to_s(rule.direction),
-        ip_and_mask_to_s(rule.src_ip, rule.src_prefix_size),
-        ip_and_mask_to_s(rule.dst_ip, rule.dst_prefix_size),
+        rule.src_ip_set ? set_to_s(rule.src_ip_set) : ip_and_mask_to_s(rule.src_ip, rule.src_prefix_size),
+        rule.dst_ip_set ? set_to_s(rule.dst_ip_set) : ip_and_mask_to_s(rule.dst_ip, rule.dst_prefix_size),
         prot_to_s(rule.protocol),
-        port_to_s(rule.src_port),
-        port_to_s(rule.dst_port),
+        rule.src_port_set ? set_to_s(rule.src_port_set) : port_to_s(rule.src_port),
+        rule.dst_port_set ? set_to_s(rule.dst_port_set) : port_to_s(rule.dst_port),
         ack_to_s(rule.ack),
         action_to_s(rule.action));
 }
@@ -51,27 +51,74 @@ void print_rule(rule_t rule){
 /* show all rules from the char device to the user */
 void show_rules(){
     int fd, i, count;
-    rule_t rules[MAX_RULES];
+    rule_t *rules = malloc(RULE_SIZE*MAX_RULES);
+    if (!rules){
+        perror("Error allocating memory");
+        return;
+    }
     fd = open(DEV_PATH("rules"), O_RDONLY);
     if (fd < 0){
         perror("Error opening file");
+        free(rules);
         return;
     }
     count = read(fd, rules, RULE_SIZE*MAX_RULES); // read up to the maximum size
     close(fd);
     if (count < 0){
         perror("Error reading file");
+        free(rules);
         return;
     }
     count = count / RULE_SIZE; //only print the rules that were returned
     for (i = 0; i < count; ++i)
         print_rule(rules[i]);
+    free(rules);
+}
+
+/* show the rules with the packets and bytes that hit each of them */
+void show_rule_counters(){
+    int fd, i, count;
+    rule_t *rules = malloc(RULE_SIZE*MAX_RULES);
+    rule_counter_t *counters = malloc(sizeof(rule_counter_t)*MAX_RULES);
+    rule_counters_req_t req = { .count = MAX_RULES };
+    if (!rules || !counters){
+        perror("Error allocating memory");
+        goto out;
+    }
+    req.counters = (unsigned long)counters;
+    fd = open(DEV_PATH("rules"), O_RDONLY);
+    if (fd < 0){
+        perror("Error opening file");
+        goto out;
+    }
+    count = read(fd, rules, RULE_SIZE*MAX_RULES);
+    if (count < 0 || ioctl(fd, FW_IOC_RULE_COUNTERS, &req) < 0){
+        perror("Error reading rules");
+        close(fd);
+        goto out;
+    }
+    close(fd);
+    count = count / RULE_SIZE;
+    if (req.count < count) //the rules were replaced between the read and the ioctl
+        count = req.count;
+    printf("rule		     packets		bytes	last hit\n");
+    for (i = 0; i < count; ++i){
+        printf("%-20s%12llu%17llu\t%s\n",
+            rules[i].rule_name,
+            counters[i].packets,
+            counters[i].bytes,
+            counters[i].last_hit ? time_to_s(counters[i].last_hit) : "never");
+    }
+out:
+    free(rules);
+    free(counters);
 }
 
 /* parse a user provided rule to a rule_t, or return -1 on invalid value */
 int parse_rule(char *str, rule_t *rule){
     char *tok;
     int tmp;
+    memset(rule, 0, RULE_SIZE); //fields that aren't used are 0, e.g. the sets
     tok = strtok(str, " ");
     if (sscanf(tok, "%19s", rule->rule_name) != 1)
         return -1;
@@ -82,16 +129,30 @@ int parse_rule(char *str, rule_t *rule){
         return -1;
 
     tok = strtok(NULL, " ");
-    tmp = s_to_ip_and_mask(tok, &rule->src_ip);
-    if (tmp == -1)
-        return -1;
-    rule->src_prefix_size = tmp;
+    if (tok[0] == '@'){ //an ip set, the ip itself is any
+        tmp = s_to_set(tok, SET_IP);
+        if (tmp == -1)
+            return -1;
+        rule->src_ip_set = tmp;
+    } else {
+        tmp = s_to_ip_and_mask(tok, &rule->src_ip);
+        if (tmp == -1)
+            return -1;
+        rule->src_prefix_size = tmp;
+    }
 
     tok = strtok(NULL, " ");
-    tmp = s_to_ip_and_mask(tok, &rule->dst_ip);
-    if (tmp == -1)
-        return -1;
-    rule->dst_prefix_size = tmp;
+    if (tok[0] == '@'){
+        tmp = s_to_set(tok, SET_IP);
+        if (tmp == -1)
+            return -1;
+        rule->dst_ip_set = tmp;
+    } else {
+        tmp = s_to_ip_and_mask(tok, &rule->dst_ip);
+        if (tmp == -1)
+            return -1;
+        rule->dst_prefix_size = tmp;
+    }
 
     tok = strtok(NULL, " ");
     rule->protocol = s_to_prot(tok);
@@ -99,14 +160,28 @@ int parse_rule(char *str, rule_t *rule){
         return -1;
 
     tok = strtok(NULL, " ");
-    rule->src_port = s_to_port(tok);
-    if (rule->src_port == -1)
-        return -1;
+    if (tok[0] == '@'){ //a port set, the port itself is any
+        tmp = s_to_set(tok, SET_PORT);
+        if (tmp == -1)
+            return -1;
+        rule->src_port_set = tmp;
+    } else {
+        rule->src_port = s_to_port(tok);
+        if (rule->src_port == -1)
+            return -1;
+    }
 
     tok = strtok(NULL, " ");
-    rule->dst_port = s_to_port(tok);
-    if (rule->dst_port == -1)
-        return -1;
+    if (tok[0] == '@'){
+        tmp = s_to_set(tok, SET_PORT);
+        if (tmp == -1)
+            return -1;
+        rule->dst_port_set = tmp;
+    } else {
+        rule->dst_port = s_to_port(tok);
+        if (rule->dst_port == -1)
+            return -1;
+    }
 
     tok = strtok(NULL, " ");
     rule->ack = s_to_ack(tok);
@@ -150,15 +225,54 @@ void write_rules(rule_t rules[], int count){
     close(fd);
 }
 
+/* insert, delete or replace a single rule. The position is the index of a
+ * rule, or its name. An insert goes before it, or at the end for "end".
+ */
+void edit_rule(rule_edit_op_t op, const char *pos, const char *str){
+    rule_edit_t edit;
+    char buf[FORMATTED_RULE_SIZE];
+    int fd;
+
+    memset(&edit, 0, sizeof(edit));
+    edit.op = op;
+    edit.index = -1;
+    if (pos[0] && pos[strspn(pos, "0123456789")] == '\0')
+        edit.index = atoi(pos);
+    else if (strcmp(pos, "end"))
+        strncpy(edit.name, pos, sizeof(edit.name) - 1);
+    if (str){
+        strncpy(buf, str, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+        if (parse_rule(buf, &edit.rule)){
+            printf("Invalid rule: %s\n", str);
+            return;
+        }
+    }
+    fd = open(DEV_PATH("rules"), O_WRONLY);
+    if (fd < 0){
+        perror("Error opening file");
+        return;
+    }
+    if (ioctl(fd, FW_IOC_RULE_EDIT, &edit) < 0){
+        perror("Error editing rule");
+    }
+    close(fd);
+}
+
 /* load rules from a file and write them to the char device */
 void load_rules(const char * path){
     FILE *fp;
     int count;
-    rule_t rules[MAX_RULES];
+    rule_t *rules = malloc(RULE_SIZE*MAX_RULES);
+    if (!rules){
+        perror("Error allocating memory");
+        return;
+    }
 
     fp = fopen(path, "r");
     if (!fp){
         perror("Error opening file");
+        free(rules);
         return;
     }
 
@@ -167,87 +281,290 @@ void load_rules(const char * path){
 
     if (count > 0)
         write_rules(rules, count);
+    free(rules);
 }
 
-/* show all hosts from the sysfs device to the user */
+/* show all hosts from the char device to the user */
 void show_hosts(){
-    FILE *fp;
-    int c;
-    fp = fopen(SYSFS_PATH("fw_hosts/hosts"), "r");
-    if (fp < 0){
+    char buf[4096];
+    ssize_t count;
+    int fd;
+    fd = open(DEV_PATH("hosts"), O_RDONLY);
+    if (fd < 0){
         perror("Error opening file");
         return;
     }
-    while ((c = getc(fp)) != EOF){
-        putchar(c);
+    while ((count = read(fd, buf, sizeof(buf))) > 0){
+        fwrite(buf, 1, count, stdout);
     }
-    fclose(fp);
+    if (count < 0){
+        perror("Error reading host list");
+    }
+    close(fd);
 }
 
-/* copy hosts from a file to the sysfs device */
+/* copy hosts from a file to the char device. The device takes a list of any
+ * size in as many writes as needed, and only replaces the current list when
+ * it is closed after the whole list was written. It is opened with O_TRUNC so
+ * an empty file clears the list.
+ */
 void load_hosts(const char * path){
-    struct stat file_stat;
+    char buf[65536];
+    ssize_t count;
     int src, dst;
 
     src = open(path, O_RDONLY);
-    if (!src){
+    if (src < 0){
         perror("Error opening file");
         return;
     }
-    if (fstat(src, &file_stat)){
-        perror("Error reading file stat");
+    dst = open(DEV_PATH("hosts"), O_WRONLY | O_TRUNC);
+    if (dst < 0){
+        perror("Error opening file");
         close(src);
         return;
     }
-    if (file_stat.st_size >= getpagesize()){
-        printf("Hosts list is too large, maximum size is %d\n", getpagesize());
-        close(src);
-        return;
+    while ((count = read(src, buf, sizeof(buf))) > 0){
+        if (write(dst, buf, count) != count){
+            perror("Error copying host list");
+            break;
+        }
+    }
+    if (count < 0){
+        perror("Error reading file");
     }
 
-    dst = open(SYSFS_PATH("fw_hosts/hosts"), O_WRONLY);
-    if (dst<0){
+    close(src);
+    close(dst);
+}
+
+/* parse an entry of a set - a network for an ip set, a port or a range of
+ * ports for a port set. returns -1 on invalid value
+ */
+int parse_set_entry(char *str, set_type_t type, void *entry){
+    ip_set_entry_t *ip = entry;
+    port_set_entry_t *ports = entry;
+    int tmp;
+    memset(entry, 0, sizeof(ip_set_entry_t));
+    if (type == SET_IP){
+        tmp = s_to_ip_and_mask(str, &ip->ip);
+        if (tmp == -1)
+            return -1;
+        ip->prefix_size = tmp;
+        return 0;
+    }
+    tmp = sscanf(str, "%hu-%hu", &ports->from, &ports->to);
+    if (tmp == 1)
+        ports->to = ports->from;
+    if (tmp < 1 || ports->from > ports->to){
+        printf("Invalid port %s\n", str);
+        return -1;
+    }
+    return 0;
+}
+
+/* load a set from a file and write it to the char device. The first line is
+ * "ip <name>" or "port <name>", then an entry on each line - a network, a port
+ * or a range of ports "from-to". A set with the same name is replaced.
+ */
+void load_set(const char * path){
+    char buf[FORMATTED_RULE_SIZE], type[8], *tok;
+    set_header_t *header;
+    size_t entry_size, size;
+    FILE *fp;
+    int fd;
+
+    fp = fopen(path, "r");
+    if (!fp){
         perror("Error opening file");
-        close(src);
         return;
     }
-    if (sendfile(dst, src, NULL, file_stat.st_size)<0){
-        perror("Error copying host list");
+    header = calloc(1, sizeof(set_header_t) + SET_ENTRIES_MAX * sizeof(ip_set_entry_t));
+    if (!header){
+        perror("Error allocating memory");
+        fclose(fp);
+        return;
+    }
+    if (!fgets(buf, sizeof(buf), fp) || sscanf(buf, "%7s %15s", type, header->name) != 2 ||
+        (strcmp(type, "ip") && strcmp(type, "port"))){
+        printf("Invalid set header: %s\n", buf);
+        goto out;
+    }
+    header->type = strcmp(type, "ip") ? SET_PORT : SET_IP;
+    entry_size = header->type == SET_IP ? sizeof(ip_set_entry_t) : sizeof(port_set_entry_t);
+    while (fgets(buf, sizeof(buf), fp) && header->count < SET_ENTRIES_MAX){
+        tok = strtok(buf, " \t\r\n");
+        if (!tok) //skip empty lines
+            continue;
+        if (parse_set_entry(tok, header->type, (char *)(header + 1) + header->count * entry_size))
+            goto out;
+        header->count++;
     }
 
-    close(src);
-    close(dst);
+    fd = open(DEV_PATH("sets"), O_WRONLY);
+    if (fd < 0){
+        perror("Error opening file");
+        goto out;
+    }
+    size = sizeof(set_header_t) + header->count * entry_size;
+    if (write(fd, header, size) != size){
+        perror("Error writing set");
+    }
+    close(fd);
+out:
+    fclose(fp);
+    free(header);
+}
+
+/* show the sets loaded in the firewall */
+void show_sets(void){
+    char buf[128];
+    FILE *fp;
+    fp = fopen(SYSFS_PATH("fw_sets/sets"), "r");
+    if (!fp){
+        perror("Error opening file");
+        return;
+    }
+    printf("id\ttype\tname\t\tentries\n");
+    while (fgets(buf, sizeof(buf), fp)){
+        unsigned int id, count;
+        char type[8], name[SET_NAME_MAX];
+        if (sscanf(buf, "%u %7s %15s %u", &id, type, name, &count) == 4)
+            printf("%u\t%s\t%-15s\t%u\n", id, type, name, count);
+    }
+    fclose(fp);
 }
 
 /* print a connection entry */
-void print_con(connection con){
+void print_con(conn_record_t con){
     char src_ip[16], dst_ip[16]; // max ip length: 4*3+3*1=15
     inet_ntop(AF_INET, &con.src_ip, src_ip, 16); //convert the ips to strings
     inet_ntop(AF_INET, &con.dst_ip, dst_ip, 16);
-    printf("%-15s\t%hu\t\t%-15s\t%hu\t\t%s\n",
-        src_ip, ntohs(con.src_port), dst_ip, ntohs(con.dst_port), state_to_s(con.src_state));
+    printf("%-15s\t%hu\t\t%-15s\t%hu\t\t%-12s\t%llu\t\t%llu\n",
+        src_ip, ntohs(con.src_port), dst_ip, ntohs(con.dst_port), state_to_s(con.src_state), con.packets, con.bytes);
     printf("%-15s\t%hu\t\t%-15s\t%hu\t\t%s\n",
         dst_ip, ntohs(con.dst_port), src_ip, ntohs(con.src_port), state_to_s(con.dst_state));
 }
 
-/* print the connection table */
-void show_conn_tab(void){
-    int fd;
-    connection con;
-    fd = open(DEV_PATH("conn_tab"), O_RDONLY);
+/* parse a connection table filter - an ip[/mask], a port or a state name */
+/* returns 0 on success or -1 on error */
+int parse_conn_filter(const char *str, conn_filter_t *filter){
+    char buf[20];
+    unsigned short port;
+    unsigned int ip;
+    int mask, state;
+    filter->ip = 0;
+    filter->prefix_size = 0;
+    filter->state = CONN_FILTER_ANY_STATE;
+    filter->port = htons(PORT_ANY);
+    strncpy(buf, str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    if ((state = s_to_state(buf)) >= 0){
+        filter->state = state;
+        return 0;
+    }
+    if (!strchr(buf, '.') && sscanf(buf, "%hu", &port) == 1){
+        filter->port = htons(port);
+        return 0;
+    }
+    if ((mask = s_to_ip_and_mask(buf, &ip)) >= 0){
+        filter->ip = ip;
+        filter->prefix_size = mask;
+        return 0;
+    }
+    return -1;
+}
+
+/* print the connection table, optionally only the connections matching a filter */
+void show_conn_tab(const char *filter_s){
+    int fd, i;
+    ssize_t len;
+    conn_filter_t filter;
+    conn_record_t *cons;
+    if (filter_s && parse_conn_filter(filter_s, &filter)){
+        printf("Invalid filter %s\n", filter_s);
+        return;
+    }
+    fd = open(DEV_PATH("conn_tab"), filter_s ? O_RDWR : O_RDONLY);
     if (fd<0){
         perror("Error opening file");
         return;
     }
-    printf("src_ip\t\tsrc_port\tdst_ip\t\tdst_port\tstate\n");
-    while (read(fd, &con, sizeof(connection)) == sizeof(connection)) { //read the log con by con and print them
-        print_con(con);
+    if (filter_s && write(fd, &filter, sizeof(filter)) != sizeof(filter)){
+        perror("Error setting filter");
+        close(fd);
+        return;
+    }
+    cons = malloc(CONN_READ_RECORDS * sizeof(conn_record_t));
+    if (!cons){
+        perror("Error allocating memory");
+        close(fd);
+        return;
+    }
+    printf("src_ip\t\tsrc_port\tdst_ip\t\tdst_port\tstate\t\tpackets\t\tbytes\n");
+    //read the table in large blocks of records and print them
+    while ((len = read(fd, cons, CONN_READ_RECORDS * sizeof(conn_record_t))) > 0) {
+        for (i = 0; i < len / sizeof(conn_record_t); ++i){
+            if (cons[i].version != CONN_RECORD_VERSION){
+                printf("Unsupported connection record version %d\n", cons[i].version);
+                goto out;
+            }
+            print_con(cons[i]);
+        }
     }
+    if (len < 0)
+        perror("Error reading connection table");
+out:
+    free(cons);
+    close(fd);
+}
+
+/* print a connection event */
+void print_event(conn_event_t event){
+    char src_ip[16], dst_ip[16]; // max ip length: 4*3+3*1=15
+    inet_ntop(AF_INET, &event.src_ip, src_ip, 16); //convert the ips to strings
+    inet_ntop(AF_INET, &event.dst_ip, dst_ip, 16);
+    printf("%-8u\t%-12s\t%-15s\t%hu\t\t%-15s\t%hu\t\t%s/%s\t%us\t\t%llu\t\t%llu\n",
+        event.seq, event_to_s(event.type), src_ip, ntohs(event.src_port), dst_ip, ntohs(event.dst_port),
+        state_to_s(event.src_state), state_to_s(event.dst_state), event.timestamp - event.created,
+        event.packets, event.bytes);
+}
+
+/* follow the connection events and print them as they arrive */
+void show_conn_events(void){
+    int fd, i;
+    ssize_t len;
+    unsigned int next = 0, first = 1;
+    conn_event_t events[CONN_READ_EVENTS];
+    fd = open(DEV_PATH("conn_events"), O_RDONLY);
+    if (fd<0){
+        perror("Error opening file");
+        return;
+    }
+    printf("seq\t\tevent\t\tsrc_ip\t\tsrc_port\tdst_ip\t\tdst_port\tstates\t\tduration\tpackets\t\tbytes\n");
+    //the device blocks until there are new events
+    while ((len = read(fd, events, sizeof(events))) > 0) {
+        for (i = 0; i < len / sizeof(conn_event_t); ++i){
+            if (events[i].version != CONN_EVENT_VERSION){
+                printf("Unsupported connection event version %d\n", events[i].version);
+                close(fd);
+                return;
+            }
+            if (!first && events[i].seq != next)
+                printf("-- lost %u events --\n", events[i].seq - next);
+            print_event(events[i]);
+            next = events[i].seq + 1;
+            first = 0;
+        }
+        fflush(stdout);
+    }
+    if (len < 0)
+        perror("Error reading connection events");
     close(fd);
 }
 
 int main(int argc, char const *argv[]){
-    if (argc > 3 || argc == 1){
+    if (argc > 4 || argc == 1){
         printf("Invalid number of arguments.\n");
         return -1;
     }
@@ -263,6 +580,10 @@ int main(int argc, char const *argv[]){
         show_rules();
         return 0;
     }
+    if (!strcmp(argv[1], "show_rule_counters")){
+        show_rule_counters();
+        return 0;
+    }
     if (!strcmp(argv[1], "clear_rules")){
         write_char(SYSFS_PATH("fw_rules/rules_clear"), "1");
         return 0;
@@ -271,6 +592,18 @@ int main(int argc, char const *argv[]){
         load_rules(argv[2]);
         return 0;
     }
+    if (!strcmp(argv[1], "insert_rule") && argc == 4){
+        edit_rule(RULE_EDIT_INSERT, argv[2], argv[3]);
+        return 0;
+    }
+    if (!strcmp(argv[1], "replace_rule") && argc == 4){
+        edit_rule(RULE_EDIT_REPLACE, argv[2], argv[3]);
+        return 0;
+    }
+    if (!strcmp(argv[1], "delete_rule") && argc == 3){
+        edit_rule(RULE_EDIT_DELETE, argv[2], NULL);
+        return 0;
+    }
     if (!strcmp(argv[1], "show_hosts")){
         show_hosts();
         return 0;
@@ -279,6 +612,14 @@ int main(int argc, char const *argv[]){
         load_hosts(argv[2]);
         return 0;
     }
+    if (!strcmp(argv[1], "show_sets")){
+        show_sets();
+        return 0;
+    }
+    if (!strcmp(argv[1], "load_set") && argc == 3){
+        load_set(argv[2]);
+        return 0;
+    }
     if (!strcmp(argv[1], "show_log")){
         show_log();
         return 0;
@@ -287,8 +628,12 @@ int main(int argc, char const *argv[]){
         write_char(SYSFS_PATH("fw_log/log_clear"), "1");
         return 0;
     }
+    if (!strcmp(argv[1], "show_conn_events")){
+        show_conn_events();
+        return 0;
+    }
     if (!strcmp(argv[1], "show_conn_tab")){
-        show_conn_tab();
+        show_conn_tab(argc == 3 ? argv[2] : NULL);
         return 0;
     }
     printf("Invalid argument.\n");
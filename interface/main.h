@@ -7,8 +7,8 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/sendfile.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
@@ -51,7 +51,7 @@ typedef enum {
 #define IP_VERSION      (4)
 #define PORT_ANY        (0)
 #define PORT_ABOVE_1023 (1023)
-#define MAX_RULES       (50)
+#define MAX_RULES       (8192)
 
 //netfilter values
 #define NF_DROP 0
@@ -82,11 +82,77 @@ typedef struct {
     unsigned char  protocol;           // values from: prot_t
     ack_t          ack;                // values from: ack_t
     char           action;             // valid values: NF_ACCEPT, NF_DROP
+    unsigned char  src_ip_set;         // id of an ip set to match instead of src_ip, or 0
+    unsigned char  dst_ip_set;         // as above
+    unsigned char  src_port_set;       // id of a port set to match instead of src_port, or 0
+    unsigned char  dst_port_set;       // as above
 } rule_t;
 
 #define RULE_SIZE sizeof(rule_t)
 #define FORMATTED_RULE_SIZE 100 //100 is enough for a formatted rule, taking in account maximum field lengths
 
+// the hits of a rule, as read from the rules device
+typedef struct {
+    unsigned long long packets;
+    unsigned long long bytes;
+    unsigned long long last_hit; // seconds since the epoch, 0 if the rule was never hit
+} rule_counter_t;
+
+// a request for the counters of all the rules, in the order of the rule list
+typedef struct {
+    unsigned int       count;    // in: room in counters, out: number of rules
+    unsigned int       reserved;
+    unsigned long long counters; // pointer to an array of rule_counter_t
+} rule_counters_req_t;
+
+typedef enum {
+    RULE_EDIT_INSERT    = 1,
+    RULE_EDIT_DELETE    = 2,
+    RULE_EDIT_REPLACE   = 3,
+} rule_edit_op_t;
+
+// a change of a single rule. The rest of the rules keep their hits
+typedef struct {
+    unsigned int   op;                 // values from rule_edit_op_t
+    int            index;              // position of the rule, or -1 to find it by name
+    char           name[20];           // the rule to edit when index is -1. An insert without a name goes at the end
+    rule_t         rule;               // the new rule, for insert and replace
+} rule_edit_t;
+
+#define FW_IOC_MAGIC 'f'
+#define FW_IOC_RULE_COUNTERS _IOWR(FW_IOC_MAGIC, 1, rule_counters_req_t)
+#define FW_IOC_RULE_EDIT _IOW(FW_IOC_MAGIC, 2, rule_edit_t)
+
+// named sets of addresses and ports, used by rules as "@name"
+#define SETS_MAX 64
+#define SET_NAME_MAX 16
+#define SET_ENTRIES_MAX (1 << 20)
+
+typedef enum {
+    SET_NONE = 0,
+    SET_IP   = 1,
+    SET_PORT = 2,
+} set_type_t;
+
+// a set as written to the sets device, followed by its entries
+typedef struct {
+    char           name[SET_NAME_MAX];
+    unsigned char  type;               // values from set_type_t
+    unsigned char  reserved[3];
+    unsigned int   count;              // number of entries that follow
+} set_header_t;
+
+typedef struct {
+    unsigned int   ip;
+    unsigned char  prefix_size;
+    unsigned char  reserved[3];
+} ip_set_entry_t;
+
+typedef struct {
+    unsigned short from;               // in host order
+    unsigned short to;
+} port_set_entry_t;
+
 typedef struct {
     unsigned long   timestamp;      // time of creation/update
     unsigned char   protocol;       // values from: prot_t
@@ -115,14 +181,60 @@ typedef enum {
     C_FTP_DATA
 } conn_state;
 
+// a connection record as read from the conn_tab device
+#define CONN_RECORD_VERSION 2
 typedef struct {
-    unsigned int src_ip;
+    unsigned char  version;   // CONN_RECORD_VERSION
+    unsigned char  size;      // the record size
+    unsigned char  src_state; // values from conn_state
+    unsigned char  dst_state;
+    unsigned int   src_ip;
+    unsigned int   dst_ip;
     unsigned short src_port;
-    unsigned int dst_ip;
     unsigned short dst_port;
-    char src_state;
-    char dst_state;
-} connection;
+    unsigned int   timestamp; // last packet seen
+    unsigned long long packets; // packets seen in both directions
+    unsigned long long bytes;   // bytes seen in both directions
+} __attribute__((packed)) conn_record_t;
+
+// filter for reading the conn_tab device, written to the device before reading
+#define CONN_FILTER_ANY_STATE 0xff
+typedef struct {
+    unsigned int   ip;          // either endpoint is in ip/prefix_size
+    unsigned char  prefix_size; // 0 for any ip
+    unsigned char  state;       // either side is in this state, CONN_FILTER_ANY_STATE for any
+    unsigned short port;        // either endpoint uses this port, PORT_ANY for any
+} __attribute__((packed)) conn_filter_t;
+
+#define CONN_READ_RECORDS 4096 //number of records read from the conn_tab at a time
+
+// connection lifecycle events, as read from the conn_events device
+typedef enum {
+    CONN_EVENT_NEW          = 1,
+    CONN_EVENT_ESTABLISHED  = 2,
+    CONN_EVENT_BLOCKED      = 3,
+    CONN_EVENT_EXPIRED      = 4,
+    CONN_EVENT_EVICTED      = 5,
+} conn_event_type;
+
+#define CONN_EVENT_VERSION 2
+typedef struct {
+    unsigned char  version;   // CONN_EVENT_VERSION
+    unsigned char  type;      // values from conn_event_type
+    unsigned char  src_state; // values from conn_state
+    unsigned char  dst_state;
+    unsigned int   seq;       // a gap in the numbers means events were lost
+    unsigned int   src_ip;
+    unsigned int   dst_ip;
+    unsigned short src_port;
+    unsigned short dst_port;
+    unsigned int   created;   // time the connection was added
+    unsigned int   timestamp; // last packet seen
+    unsigned long long packets; // packets seen in both directions
+    unsigned long long bytes;   // bytes seen in both directions
+} __attribute__((packed)) conn_event_t;
+
+#define CONN_READ_EVENTS 256 //number of events read from the conn_events at a time
 
 #include "util.h"
 
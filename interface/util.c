@@ -244,6 +244,51 @@ char * port_to_s(unsigned short port){
     return "ERR";
 }
 
+/* the sets loaded in the firewall, by id, read from sysfs when first needed */
+char set_names[SETS_MAX][SET_NAME_MAX + 1]; // "@name"
+set_type_t set_types[SETS_MAX];
+int sets_read = 0;
+
+/* read the list of sets from sysfs */
+void read_sets(void){
+    FILE *fp;
+    unsigned int id, count;
+    char type[8], name[SET_NAME_MAX];
+    sets_read = 1;
+    fp = fopen(SYSFS_PATH("fw_sets/sets"), "r");
+    if (!fp){
+        perror("Error opening file");
+        return;
+    }
+    while (fscanf(fp, "%u %7s %15s %u", &id, type, name, &count) == 4){
+        if (id >= SETS_MAX)
+            continue;
+        set_types[id] = strcmp(type, "ip") ? SET_PORT : SET_IP;
+        sprintf(set_names[id], "@%s", name);
+    }
+    fclose(fp);
+}
+
+/* convert "@name" to the id of a set of the given type, or -1 if there is none */
+int s_to_set(char *str, set_type_t type){
+    int id;
+    if (!sets_read)
+        read_sets();
+    for (id = 1; id < SETS_MAX; ++id){
+        if (set_types[id] == type && !strcmp(str, set_names[id]))
+            return id;
+    }
+    printf("Unknown %s set %s\n", type == SET_IP ? "ip" : "port", str);
+    return -1;
+}
+
+/* convert a set id to "@name" */
+char * set_to_s(int id){
+    if (!sets_read)
+        read_sets();
+    return set_names[id][0] ? set_names[id] : "@?";
+}
+
 /* convert a connection state to a string */
 char * state_to_s(conn_state state){
     switch (state){
@@ -274,3 +319,31 @@ char * state_to_s(conn_state state){
     }
     return "ERR";
 }
+
+/* convert a string to a connection state */
+/* returns the state or -1 on error */
+int s_to_state(char *str){
+    int state;
+    for (state = C_CLOSED; state <= C_FTP_DATA; ++state){
+        if (!strcmp(str, state_to_s(state)))
+            return state;
+    }
+    return -1;
+}
+
+/* convert a connection event type to a string */
+char * event_to_s(conn_event_type type){
+    switch (type){
+    case CONN_EVENT_NEW:
+        return "NEW";
+    case CONN_EVENT_ESTABLISHED:
+        return "ESTABLISHED";
+    case CONN_EVENT_BLOCKED:
+        return "BLOCKED";
+    case CONN_EVENT_EXPIRED:
+        return "EXPIRED";
+    case CONN_EVENT_EVICTED:
+        return "EVICTED";
+    }
+    return "ERR";
+}
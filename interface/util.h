@@ -29,6 +29,12 @@ char * reason_to_s(int reason);
 int s_to_port(char *str);
 char * port_to_s(unsigned short port);
 
+int s_to_set(char *str, set_type_t type);
+char * set_to_s(int id);
+
 char * state_to_s(conn_state state);
+int s_to_state(char *str);
+
+char * event_to_s(conn_event_type type);
 
 #endif